@@ -1,8 +1,15 @@
 #include "CGI.hpp"
 
-CGIHandler::CGIHandler() {}
+CGIHandler::CGIHandler()
+    : _pid(-1), _stdin_fd(-1), _stdout_fd(-1), _input(NULL), _input_offset(0),
+      _exited(false), _status(0), _head_parsed(false), _streaming(false), _chunked(false), _remaining(0), _gzip(NULL),
+      _fastcgi(NULL), _request_id(0), _bad_gateway(false) {}
 
-CGIHandler::~CGIHandler() {}
+CGIHandler::~CGIHandler()
+{
+    terminate();
+    delete _gzip;
+}
 
 std::string to_string_c98(size_t val);
 
@@ -31,13 +38,27 @@ void CGIHandler::freeEnvArray(char **env)
     delete[] env;
 }
 
-std::string CGIHandler::execute(const std::string &scriptPath, const requestParser &request, const std::map<std::string, std::string> &envVars, const std::string &interpreter)
+static bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+bool CGIHandler::start(const std::string &scriptPath, const requestParser &request, const std::string &interpreter)
 {
     int stdin_pipe[2];
     int stdout_pipe[2];
 
-    if (pipe(stdin_pipe) == -1 || pipe(stdout_pipe) == -1)
-        throw std::runtime_error("pipe() failed");
+    if (pipe2(stdin_pipe, O_CLOEXEC) == -1)
+        return false;
+    if (pipe2(stdout_pipe, O_CLOEXEC) == -1)
+    {
+        close(stdin_pipe[0]);
+        close(stdin_pipe[1]);
+        return false;
+    }
+
+    std::map<std::string, std::string> envVars = prepareCGIEnv(request);
 
     pid_t pid = fork();
     if (pid < 0)
@@ -46,13 +67,26 @@ std::string CGIHandler::execute(const std::string &scriptPath, const requestPars
         close(stdin_pipe[1]);
         close(stdout_pipe[0]);
         close(stdout_pipe[1]);
-        throw std::runtime_error("fork() failed");
+        return false;
     }
 
     if (pid == 0)
     {
         // CHILD
-        dup2(stdin_pipe[0], STDIN_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+
+        // A spooled body is handed to the script as its stdin directly
+        int body_fd = -1;
+        if (request.isBodyInFile())
+            body_fd = open(request.getBodyPath().c_str(), O_RDONLY);
+        if (body_fd != -1)
+        {
+            dup2(body_fd, STDIN_FILENO);
+            close(body_fd);
+        }
+        else
+            dup2(stdin_pipe[0], STDIN_FILENO);
         dup2(stdout_pipe[1], STDOUT_FILENO);
         close(stdin_pipe[0]);
         close(stdin_pipe[1]);
@@ -81,64 +115,171 @@ std::string CGIHandler::execute(const std::string &scriptPath, const requestPars
         freeEnvArray(envp);
         exit(EXIT_FAILURE);
     }
-    else
-    {
-        // PARENT
-        close(stdin_pipe[0]);
-        close(stdout_pipe[1]);
 
-        if (request.getMethod() == "POST" && !request.getBody().empty())
-        {
-            write(stdin_pipe[1], request.getBody().c_str(), request.getBody().size());
-        }
-        close(stdin_pipe[1]);
+    // PARENT
+    close(stdin_pipe[0]);
+    close(stdout_pipe[1]);
+    _pid = pid;
+    _stdin_fd = stdin_pipe[1];
+    _stdout_fd = stdout_pipe[0];
 
-        std::ostringstream output;
-        char buffer[4096];
-        ssize_t bytesRead;
+    if (!setNonBlocking(_stdin_fd) || !setNonBlocking(_stdout_fd))
+    {
+        terminate();
+        return false;
+    }
 
-        int status = 0;
-        time_t start_time = time(NULL);
-        const int timeout = 5; 
+    if (request.getMethod() == "POST" && !request.isBodyInFile() && !request.getBody().empty())
+        _input = &request.getBody();
+    else
+        closeStdin();
+    return true;
+}
 
-        while (42)
+// Pushes as much of the in-memory request body into the script's stdin as the
+// pipe takes. Returns 1 once everything is written, 0 if the pipe is full and
+// -1 if the script stopped reading. The caller closes the pipe afterwards.
+int CGIHandler::writeInput()
+{
+    while (_input && _input_offset < _input->size())
+    {
+        ssize_t written = write(_stdin_fd, _input->data() + _input_offset, _input->size() - _input_offset);
+        if (written > 0)
         {
-            pid_t result = waitpid(pid, &status, WNOHANG);
-            if (result == 0)
-            {
-                if (time(NULL) - start_time >= timeout)
-                {
-                    kill(pid, SIGKILL);
-                    waitpid(pid, &status, 0);
-                    close(stdout_pipe[0]);
-                    throw std::runtime_error("CGI script timed out");
-                }
-                usleep(100000); 
-            }
-            else if (result > 0)
-            {
-                while ((bytesRead = read(stdout_pipe[0], buffer, sizeof(buffer))) > 0)
-                {
-                    output.write(buffer, bytesRead);
-                }
-                break;
-            }
-            else
-            {
-                close(stdout_pipe[0]);
-                throw std::runtime_error("waitpid() failed");
-            }
+            _input_offset += written;
+            continue;
         }
+        if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (written == -1 && errno == EINTR)
+            continue;
+        return -1;
+    }
+    return 1;
+}
 
-        close(stdout_pipe[0]);
+// Reads what the script has written to stdout, at most READS_PER_EVENT
+// buffers at a time so a fast script cannot outrun the client by more than
+// that; the pipe is level-triggered and reports the rest. Returns 1 on end of
+// file, 0 when more may follow and -1 on a read error.
+int CGIHandler::readOutput()
+{
+    char buffer[65536];
 
-        if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+    for (int reads = 0; reads < READS_PER_EVENT;)
+    {
+        ssize_t bytesRead = read(_stdout_fd, buffer, sizeof(buffer));
+        if (bytesRead > 0)
         {
-            throw std::runtime_error("CGI script exited with error");
+            _output.append(buffer, bytesRead);
+            ++reads;
+            continue;
         }
-
-        return output.str();
+        if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (bytesRead == -1 && errno == EINTR)
+            continue;
+        return bytesRead == 0 ? 1 : -1;
     }
+    return 0;
+}
+
+void CGIHandler::setExitStatus(int status)
+{
+    _exited = true;
+    _status = status;
+}
+
+// Kills the script and drops both pipes. The child is still reaped by the
+// server's SIGCHLD handling.
+void CGIHandler::terminate()
+{
+    if (_pid > 0 && !_exited)
+        kill(_pid, SIGKILL);
+    closeStdin();
+    closeStdout();
+}
+
+bool CGIHandler::isFinished() const
+{
+    return _exited && _stdout_fd == -1;
+}
+
+bool CGIHandler::succeeded() const
+{
+    return _exited && !_bad_gateway && WIFEXITED(_status) && WEXITSTATUS(_status) == 0;
+}
+
+bool CGIHandler::isStreaming() const
+{
+    return _streaming;
+}
+
+pid_t CGIHandler::getPid() const
+{
+    return _pid;
+}
+
+int CGIHandler::getStdinFd() const
+{
+    return _stdin_fd;
+}
+
+int CGIHandler::getStdoutFd() const
+{
+    return _stdout_fd;
+}
+
+void CGIHandler::closeStdin()
+{
+    if (_stdin_fd != -1)
+        close(_stdin_fd);
+    _stdin_fd = -1;
+}
+
+void CGIHandler::closeStdout()
+{
+    if (_stdout_fd != -1)
+        close(_stdout_fd);
+    _stdout_fd = -1;
+}
+
+void CGIHandler::attachFastCGI(FastCGIConnection *conn, unsigned short request_id)
+{
+    _fastcgi = conn;
+    _request_id = request_id;
+}
+
+void CGIHandler::detachFastCGI()
+{
+    _fastcgi = NULL;
+    _request_id = 0;
+}
+
+FastCGIConnection *CGIHandler::getFastCGI() const
+{
+    return _fastcgi;
+}
+
+unsigned short CGIHandler::getRequestId() const
+{
+    return _request_id;
+}
+
+void CGIHandler::appendOutput(const std::string &data)
+{
+    _output.append(data);
+}
+
+// The FastCGI request has ended; app_status is the application's exit status,
+// or -1 if the application or the connection to it failed.
+void CGIHandler::endOutput(int app_status)
+{
+    _exited = true;
+    if (app_status < 0)
+        _bad_gateway = true;
+    else
+        _status = W_EXITCODE(app_status & 0xff, 0);
 }
 
 char to_cgi_char(char c)
@@ -175,7 +316,7 @@ std::map<std::string, std::string> CGIHandler::prepareCGIEnv(const requestParser
         if (headers.find("Content-Length") != headers.end())
             env["CONTENT_LENGTH"] = headers.at("Content-Length");
         else
-            env["CONTENT_LENGTH"] = to_string_c98(req.getBody().size());
+            env["CONTENT_LENGTH"] = to_string_c98(req.getBodySize());
 
         if (headers.find("Content-Type") != headers.end())
             env["CONTENT_TYPE"] = headers.at("Content-Type");
@@ -193,104 +334,182 @@ std::map<std::string, std::string> CGIHandler::prepareCGIEnv(const requestParser
         std::string value = it->second;
 
         std::transform(key.begin(), key.end(), key.begin(), to_cgi_char);
+        // A chunked body reaches the script decoded, with CONTENT_LENGTH set
+        if (req.isChunked() && key == "TRANSFER_ENCODING")
+            continue;
 
         env["HTTP_" + key] = value;
     }
     return env;
 }
 
-std::string CGIHandler::handleCGI(const std::string &scriptPath, const requestParser &request, std::string interpreter, int client_fd)
+// Parses the header block at the start of the script's output into response
+// and returns where the body starts, or npos while the block is incomplete.
+// A Status header sets the status line. Content-Length is handed back instead
+// of copied, since the caller decides how the body is framed, and the
+// hop-by-hop Transfer-Encoding and Connection are dropped.
+size_t CGIHandler::parseHead(const std::string &output, Response &response, std::string &length)
 {
-    Response response;
-    std::map<std::string, std::string> env = CGIHandler::prepareCGIEnv(request);
-
-    try
+    size_t pos = output.find("\r\n\r\n");
+    size_t separator_len = 4;
+    size_t lf = output.find("\n\n");
+    if (lf < pos)
     {
-        std::string cgiOutput = execute(scriptPath, request, env, interpreter);
+        pos = lf;
+        separator_len = 2;
+    }
+    if (pos == std::string::npos)
+        return std::string::npos;
 
-        size_t pos = cgiOutput.find("\r\n\r\n");
-        size_t separator_len = 4;
-        if (pos == std::string::npos)
-        {
-            pos = cgiOutput.find("\n\n");
-            separator_len = 2;
-        }
+    std::istringstream headerStream(output.substr(0, pos));
+    std::string line;
+    response.setStatus(200, "OK");
 
-        if (pos != std::string::npos)
-        {
-            std::string headerPart = cgiOutput.substr(0, pos);
-            std::string bodyPart = cgiOutput.substr(pos + separator_len);
-
-            std::istringstream headerStream(headerPart);
-            std::string line;
-            response.setStatus(200, "OK");
-
-            while (std::getline(headerStream, line))
-            {
-                if (line.empty())
-                    break;
-
-                size_t colon = line.find(':');
-                if (colon != std::string::npos)
-                {
-                    std::string key = line.substr(0, colon);
-                    std::string value = line.substr(colon + 1);
-                    key.erase(key.find_last_not_of(" \t\r\n") + 1);
-                    value.erase(0, value.find_first_not_of(" \t\r\n"));
-                    value.erase(value.find_last_not_of(" \t\r\n") + 1);
-
-                    if (key == "Set-Cookie")
-                    {
-                        response.addHeader("Set-Cookie", value);
-                    }
-                    else
-                    {
-                        response.addHeader(key, value);
-                    }
-                }
-            }
-
-            response.setBody(bodyPart);
-
-            if (response.getHeaders().find("Content-Type") == response.getHeaders().end())
-                response.addHeader("Content-Type", "text/html");
-
-            response.addHeader("Content-Length", to_string_c98(bodyPart.size()));
-        }
-        else
+    while (std::getline(headerStream, line))
+    {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+
+        std::string key = line.substr(0, colon);
+        std::string value = line.substr(colon + 1);
+        key.erase(key.find_last_not_of(" \t\r\n") + 1);
+        value.erase(0, value.find_first_not_of(" \t\r\n"));
+        value.erase(value.find_last_not_of(" \t\r\n") + 1);
+
+        std::string name = key;
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name == "status")
         {
-            response.setStatus(200, "OK");
-            response.setBody(cgiOutput);
-            response.addHeader("Content-Type", "text/html");
-            response.addHeader("Content-Length", to_string_c98(cgiOutput.size()));
+            int code = std::atoi(value.c_str());
+            size_t space = value.find(' ');
+            if (code >= 100 && code <= 599)
+                response.setStatus(code, space == std::string::npos ? "" : value.substr(space + 1));
         }
-        return response.toString();
+        else if (name == "content-length")
+            length = value;
+        else if (name != "transfer-encoding" && name != "connection")
+            response.addHeader(key, value);
     }
-    catch (const std::exception &e)
+
+    if (response.getHeaders().find("Content-Type") == response.getHeaders().end())
+        response.addHeader("Content-Type", "text/html");
+    return pos + separator_len;
+}
+
+Response CGIHandler::buildResponse(const ConfigParser::ServerConfig &serverConfig) const
+{
+    Response response;
+
+    if (_bad_gateway)
+        return Response::buildErrorResponse(502, "Bad Gateway", serverConfig);
+    if (!succeeded())
+        return Response::buildErrorResponse(500, "Internal Server Error", serverConfig);
+
+    std::string length;
+    size_t body = parseHead(_output, response, length);
+    if (body != std::string::npos)
     {
-        if(e.what() == std::string("CGI script timed out"))
-        {
-            Utils::log("CGI script timed out for " + scriptPath, AnsiColor::BOLD_RED);
-            send_error_response(client_fd, 504, "Gateway Timeout", response.serverConfig);
-            response.setStatus(504, "Gateway Timeout");
-        }
-        else if (e.what() == std::string("CGI script exited with error"))
-        {
-            send_error_response(client_fd, 500, "Internal Server Error", response.serverConfig);
-            response.setStatus(500, "Internal Server Error");
-        }
-        else
+        response.releaseBody().assign(_output, body, std::string::npos);
+    }
+    else
+    {
+        response.setStatus(200, "OK");
+        response.setBody(_output);
+        response.addHeader("Content-Type", "text/html");
+    }
+    response.addHeader("Content-Length", to_string_c98(response.getBody().size()));
+    return response;
+}
+
+// Called as output arrives until the header block is complete. The body is
+// then forwarded as the script produces it, framed by the Content-Length the
+// script sent or else chunked; a body gzip applies to is compressed on the
+// way and always chunked. An HTTP/1.0 client cannot take chunks, so without
+// a length its response is collected whole and sent by buildResponse() once
+// the script is done.
+bool CGIHandler::beginStream(const requestParser &request, const ConfigParser::ServerConfig &serverConfig, Response &head)
+{
+    if (_head_parsed)
+        return false;
+
+    std::string length;
+    size_t body = parseHead(_output, head, length);
+    if (body == std::string::npos)
+        return false;
+    _head_parsed = true;
+
+    bool http11 = request.getHttpVersion() == "HTTP/1.1";
+    const std::map<std::string, std::string> &headers = head.getHeaders();
+    if (http11 && head.getStatusCode() == 200 && !headers.count("Content-Encoding") &&
+        Response::gzipEligible(serverConfig, headers.find("Content-Type")->second, static_cast<size_t>(-1)))
+    {
+        head.addHeader("Vary", "Accept-Encoding");
+        if (Gzip::accepted(request.getHeader("Accept-Encoding"), "gzip"))
         {
-            Utils::log("CGI execution failed for " + scriptPath + ": " + e.what(), AnsiColor::BOLD_RED);
-            send_error_response(client_fd, 500, "Internal Server Error", response.serverConfig);
-            response.setStatus(500, "Internal Server Error");
+            _gzip = new GzipEncoder();
+            head.addHeader("Content-Encoding", "gzip");
+            length.clear();
         }
-        std::string err = "CGI Error: ";
-        err += e.what();
-        response.setBody(err);
-        response.addHeader("Content-Type", "text/html");
-        response.addHeader("Content-Length", to_string_c98(err.size()));
     }
 
-    return response.toString();
+    bool valid = !length.empty() && length.size() <= 18 &&
+                 length.find_first_not_of("0123456789") == std::string::npos;
+    if (valid)
+    {
+        _remaining = std::strtoul(length.c_str(), NULL, 10);
+        head.addHeader("Content-Length", length);
+    }
+    else if (http11)
+    {
+        _chunked = true;
+        head.addHeader("Transfer-Encoding", "chunked");
+    }
+    else
+        return false;
+
+    _output.erase(0, body);
+    _streaming = true;
+    return true;
+}
+
+// Moves the body bytes read so far into out, framed for the client. Output
+// past the announced length is dropped.
+void CGIHandler::takeBody(std::string &out)
+{
+    if (_gzip)
+    {
+        std::string compressed;
+        if (!_gzip->write(_output.data(), _output.size(), compressed))
+            terminate();
+        Response::appendChunk(out, compressed.data(), compressed.size());
+    }
+    else if (_chunked)
+        Response::appendChunk(out, _output.data(), _output.size());
+    else
+    {
+        size_t take = std::min(_output.size(), _remaining);
+        out.append(_output, 0, take);
+        _remaining -= take;
+    }
+    _output.clear();
+}
+
+// Ends a streamed body. Returns false if the script failed or wrote less than
+// it announced; with the head already sent, the caller can only close the
+// connection so the client sees the response as cut short.
+bool CGIHandler::finishStream(std::string &out)
+{
+    if (!succeeded() || (!_chunked && _remaining > 0))
+        return false;
+    if (_gzip)
+    {
+        std::string compressed;
+        if (!_gzip->finish(compressed))
+            return false;
+        Response::appendChunk(out, compressed.data(), compressed.size());
+    }
+    if (_chunked)
+        out.append("0\r\n\r\n");
+    return true;
 }
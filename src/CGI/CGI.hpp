@@ -2,25 +2,82 @@
 
 #include <sys/wait.h>
 #include <cstring>
+#include <ctime>
 #include "../Request/Request.hpp"   // Assuming requestParser is defined in this header
 #include "../Response/Response.hpp" // For Response class
 #include "../Client/Client.hpp"     // For Client class
+#include "../Parser/ConfigParser.hpp"
+#include "FastCGI.hpp"
 class Request;                      // Forward declaration if you want to use Request in prepareCGIEnv
+class Response;
 
+// One running CGI script. start() forks the child and returns right away; the
+// server then drives the non-blocking pipes from its epoll loop and reaps the
+// child on SIGCHLD. Once the script's header block is in, beginStream() lets
+// the server send the head and forward the body as it is produced; otherwise
+// the collected output is turned into a Response when the script is done.
+// A request passed to a FastCGI application has no child: the server feeds
+// the application's output in with appendOutput() and endOutput().
 class CGIHandler
 {
 public:
+    static const int READS_PER_EVENT = 4;
+
     CGIHandler();
     ~CGIHandler();
 
-    // Execute the CGI script with given env and request body (for POST)
-    std::string execute(const std::string &scriptPath, const requestParser &request, const std::map<std::string, std::string> &envVars, const std::string &interpreter);
-    std::string handleCGI(const std::string &scriptPath, const requestParser &request, std::string interpreter, int client_fd);
+    bool start(const std::string &scriptPath, const requestParser &request, const std::string &interpreter);
+    int writeInput();
+    int readOutput();
+    void setExitStatus(int status);
+    void terminate();
+    void closeStdin();
+    void closeStdout();
+    void attachFastCGI(FastCGIConnection *conn, unsigned short request_id);
+    void detachFastCGI();
+    void appendOutput(const std::string &data);
+    void endOutput(int app_status);
+    bool isFinished() const;
+    bool succeeded() const;
+    Response buildResponse(const ConfigParser::ServerConfig &serverConfig) const;
+    bool beginStream(const requestParser &request, const ConfigParser::ServerConfig &serverConfig, Response &head);
+    bool isStreaming() const;
+    void takeBody(std::string &out);
+    bool finishStream(std::string &out);
+
+    pid_t getPid() const;
+    int getStdinFd() const;
+    int getStdoutFd() const;
+    FastCGIConnection *getFastCGI() const;
+    unsigned short getRequestId() const;
+
     static std::map<std::string, std::string> prepareCGIEnv(const requestParser &request);
 
 private:
+    pid_t _pid;
+    int _stdin_fd;
+    int _stdout_fd;
+    const std::string *_input;
+    size_t _input_offset;
+    std::string _output;
+    bool _exited;
+    int _status;
+    bool _head_parsed;
+    bool _streaming;
+    bool _chunked;
+    size_t _remaining;
+    GzipEncoder *_gzip;
+    FastCGIConnection *_fastcgi;
+    unsigned short _request_id;
+    // The FastCGI application failed the request rather than answering it.
+    bool _bad_gateway;
+
+    CGIHandler(const CGIHandler &);
+    CGIHandler &operator=(const CGIHandler &);
+
     char **buildEnvArray(const std::map<std::string, std::string> &envVars);
     void freeEnvArray(char **env);
+    static size_t parseHead(const std::string &output, Response &response, std::string &length);
 };
 
-char to_cgi_char(char c);
\ No newline at end of file
+char to_cgi_char(char c);
@@ -0,0 +1,462 @@
+#include "FastCGI.hpp"
+#include "../Utils/Logger.hpp"
+#include "../Utils/AnsiColor.hpp"
+
+// Record types and flags of the FastCGI 1.0 specification.
+enum
+{
+    FCGI_VERSION_1 = 1,
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_ABORT_REQUEST = 2,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7,
+    FCGI_GET_VALUES = 9,
+    FCGI_GET_VALUES_RESULT = 10,
+    FCGI_RESPONDER = 1,
+    FCGI_KEEP_CONN = 1,
+    FCGI_REQUEST_COMPLETE = 0,
+    FCGI_CANT_MPX_CONN = 1
+};
+
+static const size_t HEADER_LEN = 8;
+
+std::string to_string_c98(size_t val);
+
+FastCGIConnection::Output::Output() : client_fd(-1), ended(false), app_status(0)
+{
+}
+
+FastCGIConnection::FastCGIConnection(int fd, const std::string &address, bool connecting)
+    : _fd(fd), _address(address), _connecting(connecting), _paused(false), _multiplex(false), _max_requests(1), _next_id(1),
+      _out_offset(0)
+{
+}
+
+FastCGIConnection::~FastCGIConnection()
+{
+    close(_fd);
+}
+
+// Starts a non-blocking connect to unix:<path> or host:port. Returns -1 if it
+// failed outright; connecting is set while it is still in progress.
+int FastCGIConnection::connectTo(const std::string &address, bool &connecting)
+{
+    struct sockaddr_un local;
+    struct addrinfo *result = NULL;
+    const struct sockaddr *target;
+    socklen_t target_len;
+    int family;
+
+    if (address.compare(0, 5, "unix:") == 0)
+    {
+        std::memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        address.copy(local.sun_path, sizeof(local.sun_path) - 1, 5);
+        target = reinterpret_cast<const struct sockaddr *>(&local);
+        target_len = sizeof(local);
+        family = AF_UNIX;
+    }
+    else
+    {
+        size_t colon = address.rfind(':');
+        struct addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &result) != 0)
+            return -1;
+        target = result->ai_addr;
+        target_len = result->ai_addrlen;
+        family = AF_INET;
+    }
+
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int status = fd == -1 ? -1 : connect(fd, target, target_len);
+    connecting = status == -1 && errno == EINPROGRESS;
+    if (result)
+        freeaddrinfo(result);
+    if (fd != -1 && status == -1 && !connecting)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Opens a connection and queues the FCGI_GET_VALUES query; until the answer
+// arrives the connection takes a single request.
+FastCGIConnection *FastCGIConnection::open(const std::string &address)
+{
+    bool connecting = false;
+    int fd = connectTo(address, connecting);
+    if (fd == -1)
+        return NULL;
+
+    FastCGIConnection *conn = new FastCGIConnection(fd, address, connecting);
+    std::string query;
+    appendPair(query, "FCGI_MPXS_CONNS", "");
+    appendPair(query, "FCGI_MAX_REQS", "");
+    conn->appendRecord(FCGI_GET_VALUES, 0, query.data(), query.size());
+    return conn;
+}
+
+int FastCGIConnection::getFd() const
+{
+    return _fd;
+}
+
+const std::string &FastCGIConnection::getAddress() const
+{
+    return _address;
+}
+
+bool FastCGIConnection::isConnecting() const
+{
+    return _connecting;
+}
+
+bool FastCGIConnection::hasRoom() const
+{
+    return !_paused && _requests.size() < (_multiplex ? _max_requests : 1);
+}
+
+bool FastCGIConnection::isIdle() const
+{
+    return _requests.empty();
+}
+
+size_t FastCGIConnection::getRequestCount() const
+{
+    return _requests.size();
+}
+
+bool FastCGIConnection::isPaused() const
+{
+    return _paused;
+}
+
+void FastCGIConnection::setPaused(bool paused)
+{
+    _paused = paused;
+}
+
+bool FastCGIConnection::wantsWrite() const
+{
+    if (_connecting || _out_offset < _out.size())
+        return true;
+    for (std::map<unsigned short, Request>::const_iterator it = _requests.begin(); it != _requests.end(); ++it)
+        if (!it->second.stdin_sent)
+            return true;
+    return false;
+}
+
+// Content longer than a record holds is split over several records, each
+// padded to a multiple of eight bytes as the specification recommends.
+void FastCGIConnection::appendRecord(unsigned char type, unsigned short id, const char *data, size_t length)
+{
+    size_t offset = 0;
+    do
+    {
+        size_t part = length - offset < MAX_CONTENT ? length - offset : MAX_CONTENT;
+        size_t padding = (8 - part % 8) % 8;
+        char header[HEADER_LEN] = {FCGI_VERSION_1, static_cast<char>(type),
+                                   static_cast<char>(id >> 8), static_cast<char>(id & 0xff),
+                                   static_cast<char>(part >> 8), static_cast<char>(part & 0xff),
+                                   static_cast<char>(padding), 0};
+        _out.append(header, HEADER_LEN);
+        if (part)
+            _out.append(data + offset, part);
+        _out.append(padding, '\0');
+        offset += part;
+    } while (offset < length);
+}
+
+// Name-value pairs: lengths below 128 take one byte, longer ones four with
+// the high bit set.
+void FastCGIConnection::appendPair(std::string &out, const std::string &name, const std::string &value)
+{
+    const std::string *fields[2] = {&name, &value};
+    for (int i = 0; i < 2; ++i)
+    {
+        size_t length = fields[i]->size();
+        if (length < 128)
+            out += static_cast<char>(length);
+        else
+        {
+            out += static_cast<char>((length >> 24) | 0x80);
+            out += static_cast<char>((length >> 16) & 0xff);
+            out += static_cast<char>((length >> 8) & 0xff);
+            out += static_cast<char>(length & 0xff);
+        }
+    }
+    out += name;
+    out += value;
+}
+
+// Queues FCGI_BEGIN_REQUEST and the parameters of a new request and returns
+// its id. The body follows as FCGI_STDIN records while the connection is
+// writable, read from the request only then, so the request must stay alive
+// until the application ends it or abortRequest() is called.
+unsigned short FastCGIConnection::beginRequest(int client_fd, const std::map<std::string, std::string> &params,
+                                               const requestParser &request)
+{
+    while (_next_id == 0 || _requests.count(_next_id))
+        ++_next_id;
+    unsigned short id = _next_id++;
+
+    Request &entry = _requests[id];
+    entry.client_fd = client_fd;
+    entry.body = &request;
+    entry.body_offset = 0;
+    entry.stdin_sent = false;
+
+    const char begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+    appendRecord(FCGI_BEGIN_REQUEST, id, begin, sizeof(begin));
+
+    std::string encoded;
+    for (std::map<std::string, std::string>::const_iterator it = params.begin(); it != params.end(); ++it)
+        appendPair(encoded, it->first, it->second);
+    if (!encoded.empty())
+        appendRecord(FCGI_PARAMS, id, encoded.data(), encoded.size());
+    appendRecord(FCGI_PARAMS, id, NULL, 0);
+    return id;
+}
+
+// The client is gone: whatever the application still sends for the request
+// is dropped, and its id stays taken until FCGI_END_REQUEST frees it.
+void FastCGIConnection::abortRequest(unsigned short id)
+{
+    std::map<unsigned short, Request>::iterator it = _requests.find(id);
+    if (it == _requests.end() || it->second.client_fd == -1)
+        return;
+    it->second.client_fd = -1;
+    it->second.body = NULL;
+    it->second.stdin_sent = true;
+    appendRecord(FCGI_ABORT_REQUEST, id, NULL, 0);
+}
+
+// Called once the socket reports writable or an error while connecting.
+bool FastCGIConnection::finishConnect()
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0)
+        return false;
+    _connecting = false;
+    return true;
+}
+
+// Tops the write buffer up with the next block of a request body, the
+// requests taking turns so one large upload does not hold the others back.
+void FastCGIConnection::queueStdin()
+{
+    for (std::map<unsigned short, Request>::iterator it = _requests.begin();
+         it != _requests.end() && _out.size() - _out_offset < STDIN_BLOCK; ++it)
+    {
+        Request &entry = it->second;
+        if (entry.stdin_sent)
+            continue;
+
+        size_t total = entry.body->getBodySize();
+        size_t length = total - entry.body_offset < STDIN_BLOCK ? total - entry.body_offset : STDIN_BLOCK;
+        if (length == 0)
+        {
+            appendRecord(FCGI_STDIN, it->first, NULL, 0);
+            entry.stdin_sent = true;
+        }
+        else if (entry.body->isBodyInFile())
+        {
+            char buffer[STDIN_BLOCK];
+            ssize_t bytes = pread(entry.body->getBodyFd(), buffer, length, entry.body_offset);
+            if (bytes <= 0)
+            {
+                // A body that cannot be read ends early; the application sees
+                // less than CONTENT_LENGTH
+                appendRecord(FCGI_STDIN, it->first, NULL, 0);
+                entry.stdin_sent = true;
+                continue;
+            }
+            appendRecord(FCGI_STDIN, it->first, buffer, bytes);
+            entry.body_offset += bytes;
+        }
+        else
+        {
+            appendRecord(FCGI_STDIN, it->first, entry.body->getBody().data() + entry.body_offset, length);
+            entry.body_offset += length;
+        }
+    }
+}
+
+// Writes what is queued, and request bodies as their turn comes. Returns 1
+// once everything is sent, 0 if the socket would block and -1 on error.
+int FastCGIConnection::flush()
+{
+    if (_connecting)
+        return 0;
+    while (true)
+    {
+        queueStdin();
+        if (_out_offset == _out.size())
+        {
+            _out.clear();
+            _out_offset = 0;
+            return 1;
+        }
+
+        ssize_t written = send(_fd, _out.data() + _out_offset, _out.size() - _out_offset, MSG_NOSIGNAL);
+        if (written < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        _out_offset += written;
+        if (_out_offset >= STDIN_BLOCK)
+        {
+            _out.erase(0, _out_offset);
+            _out_offset = 0;
+        }
+    }
+}
+
+// Reads at most READS_PER_EVENT buffers, like a script's pipe, and collects
+// the output of each request in outputs, one entry per request. Returns false
+// once the application has closed the connection or broken the protocol.
+bool FastCGIConnection::receive(std::vector<Output> &outputs)
+{
+    char buffer[65536];
+    bool alive = true;
+    for (int reads = 0; reads < READS_PER_EVENT;)
+    {
+        ssize_t bytes = read(_fd, buffer, sizeof(buffer));
+        if (bytes > 0)
+        {
+            _in.append(buffer, bytes);
+            ++reads;
+            continue;
+        }
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        alive = bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        break;
+    }
+
+    std::map<unsigned short, size_t> index;
+    size_t pos = 0;
+    while (_in.size() - pos >= HEADER_LEN)
+    {
+        const unsigned char *header = reinterpret_cast<const unsigned char *>(_in.data() + pos);
+        if (header[0] != FCGI_VERSION_1)
+            return false;
+        size_t length = (header[4] << 8) | header[5];
+        size_t record = HEADER_LEN + length + header[6];
+        if (_in.size() - pos < record)
+            break;
+        handleRecord(header[1], (header[2] << 8) | header[3], _in.data() + pos + HEADER_LEN, length, outputs, index);
+        pos += record;
+    }
+    _in.erase(0, pos);
+    return alive;
+}
+
+void FastCGIConnection::handleRecord(unsigned char type, unsigned short id, const char *content, size_t length,
+                                     std::vector<Output> &outputs, std::map<unsigned short, size_t> &index)
+{
+    if (type == FCGI_GET_VALUES_RESULT)
+    {
+        readValues(content, length);
+        return;
+    }
+    if (type == FCGI_STDERR)
+    {
+        if (length)
+            Utils::log("FastCGI " + _address + ": " + std::string(content, length), AnsiColor::BOLD_RED);
+        return;
+    }
+
+    std::map<unsigned short, Request>::iterator it = _requests.find(id);
+    if (it == _requests.end() || (type != FCGI_STDOUT && type != FCGI_END_REQUEST))
+        return;
+
+    Output *output = NULL;
+    if (it->second.client_fd != -1)
+    {
+        std::map<unsigned short, size_t>::iterator found = index.find(id);
+        if (found == index.end())
+        {
+            found = index.insert(std::make_pair(id, outputs.size())).first;
+            outputs.push_back(Output());
+            outputs.back().client_fd = it->second.client_fd;
+        }
+        output = &outputs[found->second];
+    }
+
+    if (type == FCGI_STDOUT)
+    {
+        if (output)
+            output->data.append(content, length);
+        return;
+    }
+
+    // FCGI_END_REQUEST: appStatus (4 bytes), protocolStatus, reserved
+    if (length < 8)
+        return;
+    const unsigned char *body = reinterpret_cast<const unsigned char *>(content);
+    int protocol_status = body[4];
+    if (protocol_status == FCGI_CANT_MPX_CONN)
+        _multiplex = false;
+    if (output)
+    {
+        output->ended = true;
+        output->app_status = protocol_status == FCGI_REQUEST_COMPLETE ? body[3] : -1;
+    }
+    _requests.erase(it);
+}
+
+void FastCGIConnection::readValues(const char *content, size_t length)
+{
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(content);
+    size_t pos = 0;
+    while (pos < length)
+    {
+        size_t lengths[2];
+        for (int i = 0; i < 2; ++i)
+        {
+            if (pos < length && data[pos] < 128)
+                lengths[i] = data[pos++];
+            else if (length - pos >= 4)
+            {
+                lengths[i] = ((data[pos] & 0x7f) << 24) | (data[pos + 1] << 16) | (data[pos + 2] << 8) | data[pos + 3];
+                pos += 4;
+            }
+            else
+                return;
+        }
+        if (length - pos < lengths[0] + lengths[1])
+            return;
+        std::string name(content + pos, lengths[0]);
+        std::string value(content + pos + lengths[0], lengths[1]);
+        pos += lengths[0] + lengths[1];
+
+        if (name == "FCGI_MPXS_CONNS")
+            _multiplex = value == "1";
+        else if (name == "FCGI_MAX_REQS" && std::atoi(value.c_str()) > 0)
+            _max_requests = std::atoi(value.c_str());
+    }
+    Utils::log("FastCGI " + _address + ": " + (_multiplex ? "multiplexing up to " + to_string_c98(_max_requests) + " requests" : "one request at a time"),
+               AnsiColor::BOLD_CYAN);
+}
+
+// The connection is going away: hands back the clients still waiting on it.
+void FastCGIConnection::failRequests(std::vector<int> &client_fds)
+{
+    for (std::map<unsigned short, Request>::iterator it = _requests.begin(); it != _requests.end(); ++it)
+        if (it->second.client_fd != -1)
+            client_fds.push_back(it->second.client_fd);
+    _requests.clear();
+}
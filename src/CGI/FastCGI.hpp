@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include "../Request/Request.hpp"
+
+// One connection to a FastCGI application (FastCGI 1.0, responder role).
+// Requests are sent with FCGI_KEEP_CONN so the connection outlives them and
+// is reused. The FCGI_GET_VALUES sent on connect asks whether the
+// application multiplexes; if it reports FCGI_MPXS_CONNS, up to its
+// FCGI_MAX_REQS requests share the connection at once, otherwise one at a
+// time. The class only frames and parses records: the server drives the
+// socket from its epoll loop and hands each request's output to the
+// CGIHandler of the client waiting for it.
+class FastCGIConnection
+{
+public:
+    // What one request produced in the records read so far. app_status is
+    // -1 if the application refused the request.
+    struct Output
+    {
+        int client_fd;
+        std::string data;
+        bool ended;
+        int app_status;
+
+        Output();
+    };
+
+    static const int READS_PER_EVENT = 4;
+    static const size_t STDIN_BLOCK = 32 * 1024;
+    static const size_t MAX_CONTENT = 65535;
+
+    static FastCGIConnection *open(const std::string &address);
+    ~FastCGIConnection();
+
+    int getFd() const;
+    const std::string &getAddress() const;
+    bool isConnecting() const;
+    bool hasRoom() const;
+    bool isIdle() const;
+    bool wantsWrite() const;
+    size_t getRequestCount() const;
+    bool isPaused() const;
+    void setPaused(bool paused);
+
+    unsigned short beginRequest(int client_fd, const std::map<std::string, std::string> &params, const requestParser &request);
+    void abortRequest(unsigned short id);
+    bool finishConnect();
+    int flush();
+    bool receive(std::vector<Output> &outputs);
+    void failRequests(std::vector<int> &client_fds);
+
+private:
+    // A request stays known until the application ends it, even once the
+    // client is gone (client_fd -1), since its id is still in use.
+    struct Request
+    {
+        int client_fd;
+        const requestParser *body;
+        size_t body_offset;
+        bool stdin_sent;
+    };
+
+    int _fd;
+    std::string _address;
+    bool _connecting;
+    // Not read from while the one client it serves is behind.
+    bool _paused;
+    bool _multiplex;
+    size_t _max_requests;
+    unsigned short _next_id;
+    std::map<unsigned short, Request> _requests;
+    std::string _out;
+    size_t _out_offset;
+    std::string _in;
+
+    FastCGIConnection(int fd, const std::string &address, bool connecting);
+    FastCGIConnection(const FastCGIConnection &);
+    FastCGIConnection &operator=(const FastCGIConnection &);
+
+    static int connectTo(const std::string &address, bool &connecting);
+    void appendRecord(unsigned char type, unsigned short id, const char *data, size_t length);
+    static void appendPair(std::string &out, const std::string &name, const std::string &value);
+    void queueStdin();
+    void handleRecord(unsigned char type, unsigned short id, const char *content, size_t length,
+                      std::vector<Output> &outputs, std::map<unsigned short, size_t> &index);
+    void readValues(const char *content, size_t length);
+};
@@ -0,0 +1,33 @@
+#include "BufferPool.hpp"
+
+BufferPool::BufferPool() {}
+
+BufferPool::~BufferPool()
+{
+    for (size_t i = 0; i < _free.size(); ++i)
+        delete _free[i];
+}
+
+std::string *BufferPool::acquire()
+{
+    if (_free.empty())
+    {
+        std::string *buffer = new std::string();
+        buffer->reserve(512);
+        return buffer;
+    }
+    std::string *buffer = _free.back();
+    _free.pop_back();
+    return buffer;
+}
+
+void BufferPool::release(std::string *buffer)
+{
+    if (_free.size() >= MAX_FREE || buffer->capacity() > MAX_CAPACITY)
+    {
+        delete buffer;
+        return;
+    }
+    buffer->clear();
+    _free.push_back(buffer);
+}
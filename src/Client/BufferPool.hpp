@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Free list of byte buffers for response heads. A released buffer keeps its
+// capacity, so serializing the next response into it does not allocate.
+// Oversized buffers and those beyond MAX_FREE are freed instead.
+class BufferPool
+{
+public:
+    static const size_t MAX_FREE = 256;
+    static const size_t MAX_CAPACITY = 16 * 1024;
+
+    BufferPool();
+    ~BufferPool();
+
+    std::string *acquire();
+    void release(std::string *buffer);
+
+private:
+    std::vector<std::string *> _free;
+
+    BufferPool(const BufferPool &);
+    BufferPool &operator=(const BufferPool &);
+};
@@ -1,15 +1,45 @@
 #include "Client.hpp"
+#include "../CGI/CGI.hpp"
 
-Client::Client() : _fd(-1), _request_complete(false), _response_ready(false), _content_length(0)
+BufferPool Client::_buffers;
+
+Client::Client() : _fd(-1), _request_complete(false), _response_ready(false), _output_offset(0),
+                   _keep_alive(false), _nopush(false), _corked(false), _requests_served(0), _cgi(NULL)
+{
+}
+
+Client::Client(int fd) : _fd(fd), _request_complete(false), _response_ready(false), _output_offset(0),
+                         _keep_alive(false), _nopush(false), _corked(false), _requests_served(0), _cgi(NULL)
 {
 }
 
-Client::Client(int fd) : _fd(fd), _request_complete(false), _response_ready(false), _content_length(0)
+Client::OutputChunk::OutputChunk() : buffer(NULL), blob(NULL), item(NULL), file(NULL), gzip(NULL), file_offset(0),
+                                     file_remaining(0)
 {
 }
 
 Client::~Client()
 {
+    discardOutput();
+    clearCGI();
+}
+
+// Readies a recycled client for a new connection. Its buffers are cleared
+// but keep their capacity.
+void Client::reset(int fd)
+{
+    discardOutput();
+    clearCGI();
+    _fd = fd;
+    _buffer.clear();
+    _request_complete = false;
+    _response_ready = false;
+    _request.reset();
+    _keep_alive = false;
+    _nopush = false;
+    _corked = false;
+    _requests_served = 0;
+    _timer = TimerWheel::Timer();
 }
 
 int Client::getFd() const
@@ -27,112 +57,298 @@ bool Client::isResponseReady() const
     return _response_ready;
 }
 
-void Client::appendToBuffer(const std::string &data)
+void Client::appendToBuffer(const char *data, size_t len)
 {
-    _buffer += data;
+    _buffer.append(data, len);
 }
 
+// Feeds newly buffered bytes to the request parser. Consumed bytes are dropped
+// from the buffer, so it only ever holds an unfinished header line or the start
+// of a pipelined request.
 bool Client::processRequest()
 {
     if (_request_complete)
-    {
         return true;
-    }
+    if (_buffer.empty())
+        return false;
+
+    size_t used = _request.feed(_buffer.data(), _buffer.size());
+    _buffer.erase(0, used);
+    _request_complete = _request.isComplete();
+    return _request_complete;
+}
+
+void Client::beginRequestBody(size_t bodyBufferSize, size_t bodyLimit)
+{
+    _request.beginBody(bodyBufferSize, bodyLimit);
+}
+
+// Resets the per-request state so the connection can be reused. Bytes that
+// arrived after the current request (pipelining) are kept for the next one.
+void Client::clearResponse()
+{
+    _response_ready = false;
+    _request_complete = false;
+    _request.reset();
+    ++_requests_served;
+}
+
+bool Client::hasPendingData() const
+{
+    return !_buffer.empty();
+}
+
+void Client::queueOutput(const std::string &data)
+{
+    if (data.empty())
+        return;
+    _output.push_back(OutputChunk());
+    _output.back().data = data;
+}
+
+// Takes the body over without copying it; body is left empty.
+void Client::queueBody(std::string &body)
+{
+    if (body.empty())
+        return;
+    _output.push_back(OutputChunk());
+    _output.back().data.swap(body);
+}
 
-    size_t header_end_pos = _buffer.find("\r\n\r\n");
-    if (header_end_pos == std::string::npos)
+// Queues an empty buffer from the pool for the caller to serialize into. It
+// goes back to the pool once sent.
+std::string &Client::queueBuffer()
+{
+    _output.push_back(OutputChunk());
+    _output.back().buffer = _buffers.acquire();
+    return *_output.back().buffer;
+}
+
+// Queues a buffer without copying it; it must stay valid until it is sent.
+void Client::queueStatic(const std::string *data)
+{
+    if (data->empty())
+        return;
+    _output.push_back(OutputChunk());
+    _output.back().blob = data;
+}
+
+void Client::queueCached(StaticCache::Item *item)
+{
+    if (item->body.empty())
+        return;
+    item->retain();
+    _output.push_back(OutputChunk());
+    _output.back().item = item;
+}
+
+void Client::queueFile(OpenFile *file, off_t offset, size_t length)
+{
+    if (length == 0)
+        return;
+    // The head queued before the file would otherwise leave in a segment of
+    // its own; corking packs it with the first bytes of the file.
+    if (_nopush && !_corked)
+        setCork(true);
+    file->retain();
+    _output.push_back(OutputChunk());
+    _output.back().file = file;
+    _output.back().file_offset = offset;
+    _output.back().file_remaining = length;
+}
+
+// Compresses the file range into the response as it is sent; the body is
+// framed with the chunked transfer coding.
+void Client::queueGzip(OpenFile *file, off_t offset, size_t length)
+{
+    if (_nopush && !_corked)
+        setCork(true);
+    _output.push_back(OutputChunk());
+    _output.back().gzip = new GzipStream(file, offset, length);
+}
+
+void Client::discardOutput()
+{
+    for (size_t i = 0; i < _output.size(); ++i)
     {
-        return false;
+        if (_output[i].buffer)
+            _buffers.release(_output[i].buffer);
+        if (_output[i].item)
+            _output[i].item->release();
+        if (_output[i].file)
+            _output[i].file->release();
+        delete _output[i].gzip;
     }
+    _output.clear();
+    _output_offset = 0;
+}
 
-    std::string header_part = _buffer.substr(0, header_end_pos);
+bool Client::hasPendingOutput() const
+{
+    return !_output.empty();
+}
 
-    bool has_content_length = false;
+const std::string &Client::chunkBytes(const OutputChunk &chunk)
+{
+    if (chunk.buffer)
+        return *chunk.buffer;
+    if (chunk.item)
+        return chunk.item->body;
+    return chunk.blob ? *chunk.blob : chunk.data;
+}
 
-    std::istringstream header_stream(header_part);
-    std::string line;
+void Client::popChunk()
+{
+    OutputChunk &chunk = _output.front();
+    if (chunk.buffer)
+        _buffers.release(chunk.buffer);
+    if (chunk.item)
+        chunk.item->release();
+    if (chunk.file)
+        chunk.file->release();
+    delete chunk.gzip;
+    _output.pop_front();
+    _output_offset = 0;
+}
 
-    if (std::getline(header_stream, line))
+// Writes as much of the output queue as the socket accepts. Consecutive
+// in-memory chunks (typically the headers and a cached body) go out in a
+// single writev(); file ranges are sent with sendfile(), and a compressed
+// file is deflated a block at a time, each one sent before the next.
+// Returns 1 once the queue is drained, 0 if the socket would block and -1 on error.
+int Client::flushOutput()
+{
+    while (!_output.empty())
     {
-        while (std::getline(header_stream, line) && !line.empty())
+        OutputChunk &chunk = _output.front();
+        ssize_t written;
+
+        if (chunk.gzip && _output_offset == chunk.data.size())
         {
-            if (!line.empty() && line[line.length() - 1] == '\r')
-            {
-                line = line.substr(0, line.length() - 1);
-            }
+            chunk.data.clear();
+            _output_offset = 0;
+            if (chunk.gzip->isFinished())
+                popChunk();
+            else if (!chunk.gzip->produce(chunk.data))
+                return -1;
+            continue;
+        }
 
-            size_t colon_pos = line.find(':');
-            if (colon_pos != std::string::npos)
+        if (chunk.file)
+        {
+            written = sendfile(_fd, chunk.file->getFd(), &chunk.file_offset, chunk.file_remaining);
+        }
+        else if (chunk.gzip)
+        {
+            written = write(_fd, chunk.data.data() + _output_offset, chunk.data.size() - _output_offset);
+        }
+        else
+        {
+            struct iovec iov[MAX_IOV];
+            int count = 0;
+            for (std::deque<OutputChunk>::const_iterator it = _output.begin();
+                 it != _output.end() && !it->file && !it->gzip && count < MAX_IOV; ++it, ++count)
             {
-                std::string key = line.substr(0, colon_pos);
-                std::string value = line.substr(colon_pos + 1);
-
-                key.erase(0, key.find_first_not_of(" \t"));
-                key.erase(key.find_last_not_of(" \t") + 1);
-                value.erase(0, value.find_first_not_of(" \t"));
-                value.erase(value.find_last_not_of(" \t") + 1);
-
-                std::string key_lower = key;
-                for (size_t i = 0; i < key_lower.length(); ++i)
-                {
-                    key_lower[i] = std::tolower(key_lower[i]);
-                }
-
-                if (key_lower == "content-length")
-                {
-                    std::istringstream iss(value);
-                    iss >> _content_length;
-                    has_content_length = true;
-                    break;
-                }
+                const std::string &bytes = chunkBytes(*it);
+                size_t skip = count == 0 ? _output_offset : 0;
+                iov[count].iov_base = const_cast<char *>(bytes.data()) + skip;
+                iov[count].iov_len = bytes.size() - skip;
             }
+            written = writev(_fd, iov, count);
         }
-    }
 
-    size_t body_start = header_end_pos + 4; // +4 for "\r\n\r\n"
-    size_t current_body_length = 0;
-    if (body_start < _buffer.length())
-    {
-        current_body_length = _buffer.length() - body_start;
-    }
+        if (written < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
 
-    if (has_content_length)
-    {
-        if (current_body_length >= _content_length)
+        if (chunk.file)
         {
-            _request.parseRequest(_buffer);
-            _request_complete = true;
-            return true;
+            // A file that shrank underneath us cannot satisfy the Content-Length we promised
+            if (written == 0)
+                return -1;
+            chunk.file_remaining -= written;
+            if (chunk.file_remaining == 0)
+                popChunk();
+            continue;
         }
-        else
+
+        if (chunk.gzip)
         {
-            return false;
+            _output_offset += written;
+            continue;
+        }
+
+        size_t left = written;
+        while (!_output.empty() && !_output.front().file && !_output.front().gzip)
+        {
+            size_t remaining = chunkBytes(_output.front()).size() - _output_offset;
+            if (left < remaining)
+            {
+                _output_offset += left;
+                break;
+            }
+            left -= remaining;
+            popChunk();
         }
     }
-    else
-    {
-        _request.parseRequest(_buffer);
-        _request_complete = true;
-        return true;
-    }
+    if (_corked)
+        setCork(false);
+    return 1;
 }
 
-std::string Client::getResponse() const
+void Client::setCork(bool cork)
 {
-    return _response;
+    int value = cork ? 1 : 0;
+    setsockopt(_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+    _corked = cork;
 }
 
-void Client::setResponse(const std::string &response)
+bool Client::isKeepAlive() const
 {
-    _response = response;
+    return _keep_alive;
 }
 
-void Client::clearResponse()
+void Client::setKeepAlive(bool keep_alive)
 {
-    _response.clear();
-    _response_ready = false;
-    _request_complete = false;
-    _buffer.clear();
+    _keep_alive = keep_alive;
+}
+
+void Client::setNoPush(bool nopush)
+{
+    _nopush = nopush;
+}
+
+int Client::getRequestsServed() const
+{
+    return _requests_served;
+}
+
+TimerWheel::Timer *Client::getTimer()
+{
+    return &_timer;
+}
+
+// The client owns the CGI handler of the request it is currently serving.
+void Client::setCGI(CGIHandler *cgi)
+{
+    clearCGI();
+    _cgi = cgi;
+}
+
+CGIHandler *Client::getCGI() const
+{
+    return _cgi;
+}
+
+void Client::clearCGI()
+{
+    delete _cgi;
+    _cgi = NULL;
 }
 
 const requestParser &Client::getRequest() const
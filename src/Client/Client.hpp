@@ -2,33 +2,105 @@
 
 #include <string>
 #include <iostream>
+#include <deque>
+#include <ctime>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "../Request/Request.hpp"
+#include "../Server/TimerWheel.hpp"
+#include "../Server/OpenFileCache.hpp"
+#include "../Server/StaticCache.hpp"
+#include "../Response/Gzip.hpp"
+#include "BufferPool.hpp"
+
+class CGIHandler;
 
 class Client
 {
+public:
+    // One entry of the output queue: bytes held in memory, a pooled buffer
+    // a response head was serialized into, a shared immutable buffer that
+    // outlives the connection (blob), a body from the static cache (item),
+    // a range of an open file that is streamed with sendfile(), or a file
+    // compressed as it is sent (gzip), its pending output held in data. The
+    // queue owns buffer and gzip and holds a reference to item and file.
+    struct OutputChunk
+    {
+        std::string data;
+        std::string *buffer;
+        const std::string *blob;
+        StaticCache::Item *item;
+        OpenFile *file;
+        GzipStream *gzip;
+        off_t file_offset;
+        size_t file_remaining;
+
+        OutputChunk();
+    };
+
 private:
     int _fd;
     std::string _buffer;
     bool _request_complete;
     bool _response_ready;
     requestParser _request;
-    std::string _response;
-    size_t _content_length;
+    std::deque<OutputChunk> _output;
+    static const int MAX_IOV = 16;
+    static BufferPool _buffers;
+    size_t _output_offset;
+    bool _keep_alive;
+    bool _nopush;
+    bool _corked;
+    int _requests_served;
+    TimerWheel::Timer _timer;
+    CGIHandler *_cgi;
 
 public:
     Client();
     Client(int fd);
     ~Client();
 
+    void reset(int fd);
     int getFd() const;
     bool isRequestComplete() const;
     bool isResponseReady() const;
 
-    void appendToBuffer(const std::string &data);
+    void appendToBuffer(const char *data, size_t len);
     bool processRequest();
-    std::string getResponse() const;
+    void beginRequestBody(size_t bodyBufferSize, size_t bodyLimit);
     void clearResponse();
     const requestParser &getRequest() const;
-    void setResponse(const std::string &response);
+    bool hasPendingData() const;
+
+    void queueOutput(const std::string &data);
+    void queueBody(std::string &body);
+    std::string &queueBuffer();
+    void queueStatic(const std::string *data);
+    void queueCached(StaticCache::Item *item);
+    void queueFile(OpenFile *file, off_t offset, size_t length);
+    void queueGzip(OpenFile *file, off_t offset, size_t length);
+    void discardOutput();
+    bool hasPendingOutput() const;
+    int flushOutput();
+
+    bool isKeepAlive() const;
+    void setKeepAlive(bool keep_alive);
+    void setNoPush(bool nopush);
+    int getRequestsServed() const;
+    TimerWheel::Timer *getTimer();
+
+    void setCGI(CGIHandler *cgi);
+    CGIHandler *getCGI() const;
+    void clearCGI();
     std::string to_string_client(size_t val);
+
+private:
+    static const std::string &chunkBytes(const OutputChunk &chunk);
+    void popChunk();
+    void setCork(bool cork);
 };
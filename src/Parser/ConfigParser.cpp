@@ -1,14 +1,27 @@
 #include "ConfigParser.hpp"
 
-ConfigParser::LocationConfig::LocationConfig() : autoindex(false) {}
+ConfigParser::LocationConfig::LocationConfig() : autoindex(false), exact(false) {}
 
-ConfigParser::Listen::Listen() : host("0.0.0.0") {}
+ConfigParser::Listen::Listen() : host("0.0.0.0"), default_server(false), backlog(0), deferred(false), fastopen(0), rcvbuf(0),
+                                 sndbuf(0), nodelay(false), nopush(false) {}
 
-ConfigParser::Listen::Listen(const std::string &h, const std::string &p) : host(h), port(p) {}
+ConfigParser::Listen::Listen(const std::string &h, const std::string &p) : host(h), port(p), default_server(false), backlog(0),
+                                                                           deferred(false), fastopen(0), rcvbuf(0), sndbuf(0),
+                                                                           nodelay(false), nopush(false) {}
 
-ConfigParser::ServerConfig::ServerConfig() : limit_client_body_size(0) {}
+bool ConfigParser::Listen::setsSocketOptions() const
+{
+    return backlog > 0 || deferred || fastopen > 0 || rcvbuf > 0 || sndbuf > 0 || nodelay || nopush;
+}
+
+ConfigParser::ServerConfig::ServerConfig() : limit_client_body_size(0), client_body_buffer_size(16 * 1024), keepalive_timeout(75), keepalive_requests(100),
+                                           client_header_timeout(60), client_body_timeout(60), send_timeout(60), cgi_timeout(5),
+                                           gzip(false), gzip_min_length(20), gzip_static(false), brotli_static(false)
+{
+    gzip_types.insert("text/html");
+}
 
-ConfigParser::ConfigParser() : pos(0), line_number(1) {}
+ConfigParser::ConfigParser() : worker_processes(1), open_file_cache_max(0), open_file_cache_valid(60), static_cache_size(0), gzip_cache_size(0), pos(0), line_number(1) {}
 
 void ConfigParser::skipWhitespace()
 {
@@ -86,16 +99,28 @@ char ConfigParser::parseSpecialChar()
     return '\0';
 }
 
+bool ConfigParser::isDirectiveName(const std::string &token)
+{
+    return (token == "server_name" || token == "listen" || token == "error_page" ||
+            token == "limit_client_body_size" || token == "autoindex" || token == "location" ||
+            token == "root" || token == "index" || token == "allowed_methods" || token == "cgi_map" ||
+            token == "fastcgi_pass" ||
+            token == "return" || token == "keepalive_timeout" || token == "keepalive_requests" ||
+            token == "worker_processes" || token == "client_body_buffer_size" ||
+            token == "client_header_timeout" || token == "client_body_timeout" ||
+            token == "send_timeout" || token == "cgi_timeout" ||
+            token == "open_file_cache" || token == "open_file_cache_valid" || token == "static_cache_size" ||
+            token == "gzip" || token == "gzip_types" || token == "gzip_min_length" || token == "gzip_cache_size" ||
+            token == "gzip_static" || token == "brotli_static");
+}
+
 std::string ConfigParser::parseDirectiveValue()
 {
     std::string value;
     std::string token;
     while ((token = parseToken()) != "ERROR")
     {
-        if (!value.empty() && (token == "server_name" || token == "listen" || token == "error_page" ||
-                               token == "limit_client_body_size" || token == "autoindex" || token == "location" ||
-                               token == "root" || token == "index" || token == "allowed_methods" || token == "cgi_map" ||
-                               token == "return"))
+        if (!value.empty() && isDirectiveName(token))
         {
             throw std::runtime_error("Missing semicolon after directive value '" + value + "' before '" + token + "' at line " + intToString(line_number));
         }
@@ -122,9 +147,7 @@ std::vector<std::string> ConfigParser::parseMultipleValues()
 
     while ((token = parseToken()) != "ERROR")
     {
-        if (!values.empty() && (token == "server_name" || token == "listen" || token == "error_page" ||
-                                token == "limit_client_body_size" || token == "autoindex" || token == "location" ||
-                                token == "root" || token == "index" || token == "allowed_methods" || token == "return" || token == "cgi_map"))
+        if (!values.empty() && isDirectiveName(token))
         {
             throw std::runtime_error("Missing semicolon after directive values before '" + token + "' at line " + intToString(line_number));
         }
@@ -294,6 +317,29 @@ void ConfigParser::parseLocation(LocationConfig &location)
                                          "' at line " + intToString(line_number));
             }
         }
+        else if (directive == "fastcgi_pass")
+        {
+            if (!location.fastcgi_pass.empty())
+                throw std::runtime_error("Duplicate 'fastcgi_pass' directive in location block");
+
+            std::string address = parseDirectiveValue();
+            if (address.compare(0, 5, "unix:") == 0)
+            {
+                // sun_path holds 108 bytes including the terminating NUL
+                if (address.size() == 5 || address.size() - 5 >= 108)
+                    throw std::runtime_error("Invalid unix socket path in 'fastcgi_pass' at line " + intToString(line_number));
+            }
+            else
+            {
+                size_t colon = address.rfind(':');
+                std::string port = colon == std::string::npos ? "" : address.substr(colon + 1);
+                if (colon == 0 || port.empty() || port.size() > 5 ||
+                    port.find_first_not_of("0123456789") != std::string::npos ||
+                    std::atoi(port.c_str()) < 1 || std::atoi(port.c_str()) > 65535)
+                    throw std::runtime_error("'fastcgi_pass' expects unix:<path> or host:port at line " + intToString(line_number));
+            }
+            location.fastcgi_pass = address;
+        }
         else if (directive == "return")
         {
             if (!location.return_directive.empty())
@@ -332,6 +378,18 @@ void ConfigParser::parseServer(ServerConfig &server)
 
     std::string directive;
     bool bodysize_seen = false;
+    bool body_buffer_seen = false;
+    bool keepalive_timeout_seen = false;
+    bool keepalive_requests_seen = false;
+    bool header_timeout_seen = false;
+    bool body_timeout_seen = false;
+    bool send_timeout_seen = false;
+    bool cgi_timeout_seen = false;
+    bool gzip_seen = false;
+    bool gzip_types_seen = false;
+    bool gzip_min_length_seen = false;
+    bool gzip_static_seen = false;
+    bool brotli_static_seen = false;
     while (true)
     {
         skipComments();
@@ -357,13 +415,21 @@ void ConfigParser::parseServer(ServerConfig &server)
         }
         else if (directive == "server_name")
         {
-            if (!server.server_name.empty())
+            if (!server.server_names.empty())
                 throw std::runtime_error("Duplicate 'server_name' directive in server block");
 
-            server.server_name = parseDirectiveValue();
+            std::vector<std::string> names = parseMultipleValues();
+            if (names.empty())
+                throw std::runtime_error("'server_name' directive cannot be empty at line " + intToString(line_number));
 
-            if (!isValidServerName(server.server_name))
-                throw std::runtime_error("Unvalid 'server_name' at line " + intToString(line_number));
+            for (size_t i = 0; i < names.size(); ++i)
+            {
+                if (!isValidServerName(names[i]))
+                    throw std::runtime_error("Unvalid 'server_name' '" + names[i] + "' at line " + intToString(line_number));
+                std::string name = names[i];
+                std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+                server.server_names.push_back(name);
+            }
         }
         else if (directive == "error_page")
         {
@@ -406,6 +472,105 @@ void ConfigParser::parseServer(ServerConfig &server)
                 throw std::runtime_error("Invalid value for 'limit_client_body_size': " + value + " at line " + intToString(line_number));
             }
         }
+        else if (directive == "client_body_buffer_size")
+        {
+            if (body_buffer_seen)
+                throw std::runtime_error("Duplicate 'client_body_buffer_size' at line " + intToString(line_number));
+            body_buffer_seen = true;
+
+            std::string value = parseDirectiveValue();
+            if (value.empty())
+                throw std::runtime_error("'client_body_buffer_size' directive cannot be empty at line " + intToString(line_number));
+
+            try
+            {
+                server.client_body_buffer_size = parseSizeToBytes(value);
+            }
+            catch (const std::invalid_argument &e)
+            {
+                throw std::runtime_error("Invalid value for 'client_body_buffer_size': " + value + " at line " + intToString(line_number));
+            }
+        }
+        else if (directive == "keepalive_timeout")
+            server.keepalive_timeout = parseTimeout(directive, keepalive_timeout_seen, 0);
+        else if (directive == "client_header_timeout")
+            server.client_header_timeout = parseTimeout(directive, header_timeout_seen, 1);
+        else if (directive == "client_body_timeout")
+            server.client_body_timeout = parseTimeout(directive, body_timeout_seen, 1);
+        else if (directive == "send_timeout")
+            server.send_timeout = parseTimeout(directive, send_timeout_seen, 1);
+        else if (directive == "cgi_timeout")
+            server.cgi_timeout = parseTimeout(directive, cgi_timeout_seen, 1);
+        else if (directive == "keepalive_requests")
+        {
+            if (keepalive_requests_seen)
+                throw std::runtime_error("Duplicate 'keepalive_requests' at line " + intToString(line_number));
+            keepalive_requests_seen = true;
+
+            std::string value = parseDirectiveValue();
+            if (value.empty() || !isDigitString(value) || std::atoi(value.c_str()) < 1)
+                throw std::runtime_error("Invalid value for 'keepalive_requests': " + value + " at line " + intToString(line_number));
+            server.keepalive_requests = std::atoi(value.c_str());
+        }
+        else if (directive == "gzip")
+        {
+            if (gzip_seen)
+                throw std::runtime_error("Duplicate 'gzip' at line " + intToString(line_number));
+            gzip_seen = true;
+
+            std::string value = parseDirectiveValue();
+            if (value != "on" && value != "off")
+                throw std::runtime_error("Invalid value for 'gzip': " + value + " at line " + intToString(line_number));
+            server.gzip = value == "on";
+        }
+        else if (directive == "gzip_types")
+        {
+            if (gzip_types_seen)
+                throw std::runtime_error("Duplicate 'gzip_types' at line " + intToString(line_number));
+            gzip_types_seen = true;
+
+            // text/html is always compressed; "*" compresses every type.
+            std::vector<std::string> types = parseMultipleValues();
+            if (types.empty())
+                throw std::runtime_error("'gzip_types' directive cannot be empty at line " + intToString(line_number));
+            for (size_t i = 0; i < types.size(); ++i)
+            {
+                std::string type = types[i];
+                std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+                if (type != "*" && type.find('/') == std::string::npos)
+                    throw std::runtime_error("Invalid MIME type '" + types[i] + "' in 'gzip_types' at line " + intToString(line_number));
+                server.gzip_types.insert(type);
+            }
+        }
+        else if (directive == "gzip_min_length")
+        {
+            if (gzip_min_length_seen)
+                throw std::runtime_error("Duplicate 'gzip_min_length' at line " + intToString(line_number));
+            gzip_min_length_seen = true;
+
+            std::string value = parseDirectiveValue();
+            try
+            {
+                server.gzip_min_length = parseSizeToBytes(value);
+            }
+            catch (const std::invalid_argument &e)
+            {
+                throw std::runtime_error("Invalid value for 'gzip_min_length': " + value + " at line " + intToString(line_number));
+            }
+        }
+        else if (directive == "gzip_static" || directive == "brotli_static")
+        {
+            bool gzip_variant = directive == "gzip_static";
+            bool &seen = gzip_variant ? gzip_static_seen : brotli_static_seen;
+            if (seen)
+                throw std::runtime_error("Duplicate '" + directive + "' at line " + intToString(line_number));
+            seen = true;
+
+            std::string value = parseDirectiveValue();
+            if (value != "on" && value != "off")
+                throw std::runtime_error("Invalid value for '" + directive + "': " + value + " at line " + intToString(line_number));
+            (gzip_variant ? server.gzip_static : server.brotli_static) = value == "on";
+        }
         else if (directive == "root")
         {
             if (!server.root.empty())
@@ -420,6 +585,13 @@ void ConfigParser::parseServer(ServerConfig &server)
         {
             LocationConfig location;
             location.path = parseToken();
+            if (location.path == "=")
+            {
+                location.exact = true;
+                location.path = parseToken();
+            }
+            if (location.path.empty() || location.path[0] != '/')
+                throw std::runtime_error("Invalid location path '" + location.path + "' at line " + intToString(line_number));
             parseLocation(location);
             server.locations.push_back(location);
             continue;
@@ -444,6 +616,9 @@ void ConfigParser::parseServer(ServerConfig &server)
         throw std::runtime_error("Expected '}' to close server block at line " +
                                  intToString(line_number));
     }
+
+    for (size_t i = 0; i < server.locations.size(); ++i)
+        server.location_trie.insert(server.locations[i].path, server.locations[i].exact, i);
 }
 
 bool ConfigParser::isValidServerName(const std::string &name)
@@ -453,10 +628,72 @@ bool ConfigParser::isValidServerName(const std::string &name)
 
     if (name.find(" ") != std::string::npos)
         return false;
-    return true;
+
+    // A wildcard is only allowed as a whole first or last label: "*.example.com"
+    // or "www.example.*".
+    size_t star = name.find('*');
+    if (star == std::string::npos)
+        return true;
+    if (name.find('*', star + 1) != std::string::npos || name.size() < 3)
+        return false;
+    if (star == 0)
+        return name[1] == '.';
+    return star == name.size() - 1 && name[star - 1] == '.';
+}
+
+// "listen host:port [default_server];"
+ConfigParser::Listen ConfigParser::parseListen(const std::string &value)
+{
+    std::istringstream iss(value);
+    std::string address;
+    std::string option;
+    iss >> address;
+
+    Listen listen_info = parseListenAddress(address);
+    while (iss >> option)
+    {
+        size_t equals = option.find('=');
+        std::string name = option.substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : option.substr(equals + 1);
+
+        if (option == "default_server")
+            listen_info.default_server = true;
+        else if (option == "deferred")
+            listen_info.deferred = true;
+        else if (option == "nodelay")
+            listen_info.nodelay = true;
+        else if (option == "nopush")
+            listen_info.nopush = true;
+        else if (equals != std::string::npos && name == "backlog")
+            listen_info.backlog = parseListenNumber(name, value);
+        else if (equals != std::string::npos && name == "fastopen")
+            listen_info.fastopen = parseListenNumber(name, value);
+        else if (equals != std::string::npos && name == "rcvbuf")
+            listen_info.rcvbuf = parseListenSize(name, value);
+        else if (equals != std::string::npos && name == "sndbuf")
+            listen_info.sndbuf = parseListenSize(name, value);
+        else
+            throw std::runtime_error("Unknown 'listen' parameter '" + option + "' at line " + intToString(line_number));
+    }
+    return listen_info;
 }
 
-ConfigParser::Listen ConfigParser::parseListen(const std::string &listen_value)
+int ConfigParser::parseListenNumber(const std::string &name, const std::string &value)
+{
+    if (value.empty() || value.size() > 9 || !isDigitString(value) || std::atoi(value.c_str()) < 1)
+        throw std::runtime_error("Invalid 'listen' " + name + " '" + value + "' at line " + intToString(line_number));
+    return std::atoi(value.c_str());
+}
+
+int ConfigParser::parseListenSize(const std::string &name, const std::string &value)
+{
+    size_t bytes = parseSizeToBytes(value);
+    if (bytes == 0 || bytes > 0x7fffffff)
+        throw std::runtime_error("Invalid 'listen' " + name + " '" + value + "' at line " + intToString(line_number));
+    return static_cast<int>(bytes);
+}
+
+ConfigParser::Listen ConfigParser::parseListenAddress(const std::string &listen_value)
 {
     size_t colon_pos = listen_value.find(':');
 
@@ -551,7 +788,8 @@ std::string ConfigParser::intToString(int value)
 
 void ConfigParser::validatePorts()
 {
-    std::set<std::string> global_ports; // track all host:port across all servers
+    std::set<std::string> default_ports; // host:port pairs that already have a default server
+    std::set<std::string> option_ports;  // host:port pairs whose socket options are set
 
     for (size_t i = 0; i < servers.size(); i++)
     {
@@ -568,11 +806,22 @@ void ConfigParser::validatePorts()
             }
             server_ports.insert(port_key);
 
-            if (global_ports.find(port_key) != global_ports.end())
+            // Several servers may share a host:port; the Host header picks
+            // between them, so only the default server has to be unique.
+            if (listen_info.default_server)
+            {
+                if (default_ports.find(port_key) != default_ports.end())
+                    throw std::runtime_error("Duplicate default server for " + port_key);
+                default_ports.insert(port_key);
+            }
+
+            // One socket serves the host:port, so its options are given once.
+            if (listen_info.setsSocketOptions())
             {
-                throw std::runtime_error("Duplicate port found across different servers: " + port_key);
+                if (option_ports.find(port_key) != option_ports.end())
+                    throw std::runtime_error("Duplicate listen options for " + port_key);
+                option_ports.insert(port_key);
             }
-            global_ports.insert(port_key);
         }
     }
 }
@@ -615,6 +864,11 @@ void ConfigParser::parseFile(const std::string &filename)
 void ConfigParser::parse()
 {
     std::string directive;
+    bool worker_processes_seen = false;
+    bool open_file_cache_seen = false;
+    bool open_file_cache_valid_seen = false;
+    bool static_cache_size_seen = false;
+    bool gzip_cache_size_seen = false;
     while ((directive = parseToken()) != "ERROR")
     {
         if (directive == "server")
@@ -623,6 +877,62 @@ void ConfigParser::parse()
             parseServer(server);
             servers.push_back(server);
         }
+        else if (directive == "worker_processes")
+        {
+            if (worker_processes_seen)
+                throw std::runtime_error("Duplicate 'worker_processes' at line " + intToString(line_number));
+            worker_processes_seen = true;
+            parseWorkerProcesses();
+        }
+        else if (directive == "open_file_cache")
+        {
+            if (open_file_cache_seen)
+                throw std::runtime_error("Duplicate 'open_file_cache' at line " + intToString(line_number));
+            open_file_cache_seen = true;
+            parseOpenFileCache();
+        }
+        else if (directive == "open_file_cache_valid")
+        {
+            open_file_cache_valid = parseTimeout(directive, open_file_cache_valid_seen, 1);
+            if (!expectSemicolon())
+                throw std::runtime_error("Expected ';' after directive 'open_file_cache_valid' at line " + intToString(line_number));
+        }
+        else if (directive == "static_cache_size")
+        {
+            if (static_cache_size_seen)
+                throw std::runtime_error("Duplicate 'static_cache_size' at line " + intToString(line_number));
+            static_cache_size_seen = true;
+
+            std::string value = parseDirectiveValue();
+            try
+            {
+                static_cache_size = value == "off" ? 0 : parseSizeToBytes(value);
+            }
+            catch (const std::invalid_argument &e)
+            {
+                throw std::runtime_error("Invalid value for 'static_cache_size': " + value + " at line " + intToString(line_number));
+            }
+            if (!expectSemicolon())
+                throw std::runtime_error("Expected ';' after directive 'static_cache_size' at line " + intToString(line_number));
+        }
+        else if (directive == "gzip_cache_size")
+        {
+            if (gzip_cache_size_seen)
+                throw std::runtime_error("Duplicate 'gzip_cache_size' at line " + intToString(line_number));
+            gzip_cache_size_seen = true;
+
+            std::string value = parseDirectiveValue();
+            try
+            {
+                gzip_cache_size = value == "off" ? 0 : parseSizeToBytes(value);
+            }
+            catch (const std::invalid_argument &e)
+            {
+                throw std::runtime_error("Invalid value for 'gzip_cache_size': " + value + " at line " + intToString(line_number));
+            }
+            if (!expectSemicolon())
+                throw std::runtime_error("Expected ';' after directive 'gzip_cache_size' at line " + intToString(line_number));
+        }
         else
         {
             throw std::runtime_error("Unknown directive: " + directive +
@@ -633,6 +943,80 @@ void ConfigParser::parse()
     validateRequiredDirectives();
 }
 
+void ConfigParser::parseWorkerProcesses()
+{
+    std::string value = parseDirectiveValue();
+
+    if (value == "auto")
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_processes = cpus > 0 ? static_cast<int>(cpus) : 1;
+    }
+    else if (!value.empty() && isDigitString(value) && std::atoi(value.c_str()) >= 1 && value.size() <= 4)
+        worker_processes = std::atoi(value.c_str());
+    else
+        throw std::runtime_error("Invalid value for 'worker_processes': " + value + " at line " + intToString(line_number));
+
+    if (!expectSemicolon())
+        throw std::runtime_error("Expected ';' after directive 'worker_processes' at line " + intToString(line_number));
+}
+
+// "open_file_cache off;" or "open_file_cache max=N;", N being the number of
+// paths remembered per worker.
+void ConfigParser::parseOpenFileCache()
+{
+    std::string value = parseDirectiveValue();
+
+    if (value == "off")
+        open_file_cache_max = 0;
+    else if (value.compare(0, 4, "max=") == 0 && value.size() > 4 && value.size() <= 10 &&
+             isDigitString(value.substr(4)) && std::atoi(value.c_str() + 4) >= 1)
+        open_file_cache_max = std::atoi(value.c_str() + 4);
+    else
+        throw std::runtime_error("Invalid value for 'open_file_cache': " + value + " at line " + intToString(line_number));
+
+    if (!expectSemicolon())
+        throw std::runtime_error("Expected ';' after directive 'open_file_cache' at line " + intToString(line_number));
+}
+
+// Timeouts are whole seconds; each may appear once per server block.
+int ConfigParser::parseTimeout(const std::string &directive, bool &seen, int min_value)
+{
+    if (seen)
+        throw std::runtime_error("Duplicate '" + directive + "' at line " + intToString(line_number));
+    seen = true;
+
+    std::string value = parseDirectiveValue();
+    if (value.empty() || !isDigitString(value) || value.size() > 7 || std::atoi(value.c_str()) < min_value)
+        throw std::runtime_error("Invalid value for '" + directive + "': " + value + " at line " + intToString(line_number));
+    return std::atoi(value.c_str());
+}
+
+int ConfigParser::getWorkerProcesses() const
+{
+    return worker_processes;
+}
+
+size_t ConfigParser::getOpenFileCacheMax() const
+{
+    return open_file_cache_max;
+}
+
+int ConfigParser::getOpenFileCacheValid() const
+{
+    return open_file_cache_valid;
+}
+
+size_t ConfigParser::getStaticCacheSize() const
+{
+    return static_cache_size;
+}
+
+size_t ConfigParser::getGzipCacheSize() const
+{
+    return gzip_cache_size;
+}
+
 size_t ConfigParser::getServerCount() const
 {
     return servers.size();
@@ -644,7 +1028,10 @@ void ConfigParser::printConfig()
     {
         std::cout << AnsiColor::BOLD_BLUE << "Server " << i + 1 << ":" << AnsiColor::BOLD_MAGENTA << std::endl;
 
-        std::cout << AnsiColor::BOLD_CYAN << "  Server name: " << AnsiColor::BOLD_MAGENTA << servers[i].server_name << std::endl;
+        std::cout << AnsiColor::BOLD_CYAN << "  Server name: " << AnsiColor::BOLD_MAGENTA;
+        for (size_t j = 0; j < servers[i].server_names.size(); j++)
+            std::cout << (j ? " " : "") << servers[i].server_names[j];
+        std::cout << std::endl;
 
         std::cout << AnsiColor::BOLD_CYAN << "  Listen: " << AnsiColor::BOLD_GREEN;
         for (size_t j = 0; j < servers[i].listen.size(); j++)
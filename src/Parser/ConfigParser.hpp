@@ -11,10 +11,19 @@
 #include <algorithm>
 #include "../Utils/AnsiColor.hpp"
 #include "../Utils/Logger.hpp"
+#include "LocationTrie.hpp"
 
 class ConfigParser
 {
 public:
+    // A complete response serialized once at startup, in the two variants
+    // that differ only by their Connection header.
+    struct Prerendered
+    {
+        std::string close;
+        std::string keep_alive;
+    };
+
     struct LocationConfig
     {
         std::string path;
@@ -22,8 +31,13 @@ public:
         std::string index;
         std::vector<std::string> allowed_methods;
         std::map<std::string, std::string> cgi;
+        // unix:<path> or host:port of a FastCGI application serving the
+        // location's scripts in place of cgi_map's interpreters.
+        std::string fastcgi_pass;
         std::string return_directive;
         bool autoindex;
+        bool exact;
+        Prerendered redirect_response;
 
         LocationConfig();
     };
@@ -32,24 +46,56 @@ public:
     {
         std::string host;
         std::string port;
+        bool default_server;
+        // Socket options; a host:port takes them from at most one listen.
+        // Zero leaves the system default.
+        int backlog;
+        bool deferred;
+        int fastopen;
+        int rcvbuf;
+        int sndbuf;
+        bool nodelay;
+        bool nopush;
+
+        static const int DEFAULT_BACKLOG = 511;
 
         Listen();
         Listen(const std::string &h, const std::string &p);
+        bool setsSocketOptions() const;
     };
 
     struct ServerConfig
     {
         std::vector<Listen> listen;
-        std::string server_name;
+        std::vector<std::string> server_names;
         std::string root;
         std::map<int, std::string> error_pages;
         size_t limit_client_body_size;
+        size_t client_body_buffer_size;
+        int keepalive_timeout;
+        int keepalive_requests;
+        int client_header_timeout;
+        int client_body_timeout;
+        int send_timeout;
+        int cgi_timeout;
+        bool gzip;
+        std::set<std::string> gzip_types;
+        size_t gzip_min_length;
+        bool gzip_static;
+        bool brotli_static;
         std::vector<LocationConfig> locations;
+        LocationTrie location_trie;
+        std::map<int, Prerendered> error_responses;
 
         ServerConfig();
     };
 
     std::vector<ServerConfig> servers;
+    int worker_processes;
+    size_t open_file_cache_max;
+    int open_file_cache_valid;
+    size_t static_cache_size;
+    size_t gzip_cache_size;
     std::string content;
     size_t pos;
     int line_number;
@@ -57,13 +103,20 @@ public:
     void skipWhitespace();
     void skipComments();
     std::string parseToken();
+    bool isDirectiveName(const std::string &token);
     char parseSpecialChar();
     std::string parseDirectiveValue();
     std::vector<std::string> parseMultipleValues();
     bool expectSemicolon();
     void parseLocation(LocationConfig &location);
     void parseServer(ServerConfig &server);
-    Listen parseListen(const std::string &listen_value);
+    void parseWorkerProcesses();
+    void parseOpenFileCache();
+    int parseTimeout(const std::string &directive, bool &seen, int min_value);
+    Listen parseListen(const std::string &value);
+    Listen parseListenAddress(const std::string &listen_value);
+    int parseListenNumber(const std::string &name, const std::string &value);
+    int parseListenSize(const std::string &name, const std::string &value);
     std::string intToString(int value);
     void validatePorts();
     void validateRequiredDirectives();
@@ -79,6 +132,11 @@ public:
     size_t parseSizeToBytes(const std::string &input);
 
     size_t getServerCount() const;
+    int getWorkerProcesses() const;
+    size_t getOpenFileCacheMax() const;
+    int getOpenFileCacheValid() const;
+    size_t getStaticCacheSize() const;
+    size_t getGzipCacheSize() const;
 
     // listen
     bool isValidIPv4(const std::string &ip);
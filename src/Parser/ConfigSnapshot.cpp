@@ -0,0 +1,27 @@
+#include "ConfigSnapshot.hpp"
+
+ConfigSnapshot::ConfigSnapshot(const std::vector<ConfigParser::ServerConfig> &servers) : _servers(servers), _refs(1) {}
+
+ConfigSnapshot::~ConfigSnapshot() {}
+
+// The caller owns the first reference.
+ConfigSnapshot *ConfigSnapshot::create(const std::vector<ConfigParser::ServerConfig> &servers)
+{
+    return new ConfigSnapshot(servers);
+}
+
+void ConfigSnapshot::retain()
+{
+    ++_refs;
+}
+
+void ConfigSnapshot::release()
+{
+    if (--_refs == 0)
+        delete this;
+}
+
+const std::vector<ConfigParser::ServerConfig> &ConfigSnapshot::getServers() const
+{
+    return _servers;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <vector>
+#include "ConfigParser.hpp"
+
+// Frozen, read-only copy of the parsed server blocks. It is built once at
+// startup; listeners and open connections hold plain pointers into it and
+// keep it alive through a reference count, so nothing on the request path
+// copies configuration.
+class ConfigSnapshot
+{
+public:
+    static ConfigSnapshot *create(const std::vector<ConfigParser::ServerConfig> &servers);
+
+    void retain();
+    void release();
+    const std::vector<ConfigParser::ServerConfig> &getServers() const;
+
+private:
+    const std::vector<ConfigParser::ServerConfig> _servers;
+    int _refs;
+
+    ConfigSnapshot(const std::vector<ConfigParser::ServerConfig> &servers);
+    ~ConfigSnapshot();
+    ConfigSnapshot(const ConfigSnapshot &);
+    ConfigSnapshot &operator=(const ConfigSnapshot &);
+};
@@ -0,0 +1,116 @@
+#include "LocationTrie.hpp"
+#include <cstring>
+
+LocationTrie::Node::Node() : prefix(LocationTrie::npos), exact(LocationTrie::npos) {}
+
+LocationTrie::LocationTrie() : _nodes(1) {}
+
+static int compareSegment(const std::string &segment, const char *other, size_t len)
+{
+    size_t common = segment.size() < len ? segment.size() : len;
+    int cmp = std::memcmp(segment.data(), other, common);
+    if (cmp != 0)
+        return cmp;
+    if (segment.size() == len)
+        return 0;
+    return segment.size() < len ? -1 : 1;
+}
+
+// Children are kept sorted by segment and binary searched.
+size_t LocationTrie::findChild(size_t node, const char *segment, size_t len) const
+{
+    const std::vector<Edge> &children = _nodes[node].children;
+    size_t low = 0;
+    size_t high = children.size();
+
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        int cmp = compareSegment(children[mid].segment, segment, len);
+        if (cmp == 0)
+            return children[mid].child;
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return npos;
+}
+
+size_t LocationTrie::addChild(size_t node, const std::string &segment)
+{
+    size_t existing = findChild(node, segment.data(), segment.size());
+    if (existing != npos)
+        return existing;
+
+    Edge edge;
+    edge.segment = segment;
+    edge.child = _nodes.size();
+    _nodes.push_back(Node());
+
+    std::vector<Edge> &children = _nodes[node].children;
+    std::vector<Edge>::iterator it = children.begin();
+    while (it != children.end() && compareSegment(it->segment, segment.data(), segment.size()) < 0)
+        ++it;
+    children.insert(it, edge);
+    return edge.child;
+}
+
+// When two locations share a path the first one keeps it.
+void LocationTrie::insert(const std::string &path, bool exact, size_t index)
+{
+    size_t node = 0;
+    size_t i = 0;
+
+    while (i < path.size())
+    {
+        if (path[i] == '/')
+        {
+            ++i;
+            continue;
+        }
+        size_t start = i;
+        while (i < path.size() && path[i] != '/')
+            ++i;
+        node = addChild(node, path.substr(start, i - start));
+    }
+
+    if (exact && _nodes[node].exact == npos)
+    {
+        _nodes[node].exact = index;
+        _nodes[node].exact_path = path;
+    }
+    else if (!exact && _nodes[node].prefix == npos)
+        _nodes[node].prefix = index;
+}
+
+// Returns the index of the matching location, or npos if none matches.
+size_t LocationTrie::find(const std::string &path) const
+{
+    size_t node = 0;
+    size_t best = _nodes[0].prefix;
+    size_t i = 0;
+
+    while (i < path.size())
+    {
+        if (path[i] == '/')
+        {
+            ++i;
+            continue;
+        }
+        size_t start = i;
+        while (i < path.size() && path[i] != '/')
+            ++i;
+
+        size_t child = findChild(node, path.data() + start, i - start);
+        if (child == npos)
+            return best;
+        node = child;
+        if (_nodes[node].prefix != npos)
+            best = _nodes[node].prefix;
+    }
+
+    if (_nodes[node].exact != npos && _nodes[node].exact_path == path)
+        return _nodes[node].exact;
+    return best;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Location lookup table compiled from a server block's locations. Prefix
+// locations are stored along the '/'-separated segments of their path, so
+// "/upload" matches "/upload" and "/upload/a" but not "/uploadx", and a
+// lookup walks the request path once no matter how many locations exist.
+// "location = /path" entries hang off the same nodes and win when the
+// request path is exactly theirs.
+class LocationTrie
+{
+public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    LocationTrie();
+
+    void insert(const std::string &path, bool exact, size_t index);
+    size_t find(const std::string &path) const;
+
+private:
+    struct Edge
+    {
+        std::string segment;
+        size_t child;
+    };
+
+    struct Node
+    {
+        std::vector<Edge> children;
+        size_t prefix;
+        size_t exact;
+        std::string exact_path;
+
+        Node();
+    };
+
+    std::vector<Node> _nodes;
+
+    size_t findChild(size_t node, const char *segment, size_t len) const;
+    size_t addChild(size_t node, const std::string &segment);
+};
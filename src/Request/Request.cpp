@@ -1,8 +1,17 @@
 #include "Request.hpp"
+#include <sys/mman.h>
 
-requestParser::requestParser() : _method(""), _path(""), _httpVersion(""), _body("") {}
+const char *const requestParser::BODY_TEMP_TEMPLATE = "/tmp/webserv_body_XXXXXX";
 
-requestParser::~requestParser() {}
+requestParser::requestParser() : _method(""), _path(""), _httpVersion(""), _body(""), _state(REQUEST_LINE),
+								 _headerSize(0), _lineScanned(0), _contentLength(0), _errorStatus(400),
+								 _bodySize(0), _bodyBufferSize(0), _bodyLimit(0), _chunked(false), _chunkState(CHUNK_SIZE),
+								 _chunkRemaining(0), _bodyFd(-1) {}
+
+requestParser::~requestParser()
+{
+	reset();
+}
 
 const std::string &requestParser::getBody() const
 {
@@ -12,88 +21,481 @@ const std::string &requestParser::getBody() const
 void requestParser::setBody(const std::string &body)
 {
 	_body = body;
+	_bodySize = body.size();
+}
+
+size_t requestParser::getBodySize() const
+{
+	return _bodySize;
+}
+
+bool requestParser::isBodyInFile() const
+{
+	return _bodyFd != -1;
+}
+
+int requestParser::getBodyFd() const
+{
+	return _bodyFd;
+}
+
+const std::string &requestParser::getBodyPath() const
+{
+	return _bodyPath;
 }
 
-void requestParser::parseRequest(const std::string &rawRequest)
+void requestParser::reset()
 {
 	_method.clear();
 	_path.clear();
 	_httpVersion.clear();
 	_headers.clear();
 	_body.clear();
+	_state = REQUEST_LINE;
+	_headerSize = 0;
+	_lineScanned = 0;
+	_contentLength = 0;
+	_errorStatus = 400;
+	_bodySize = 0;
+	_bodyBufferSize = 0;
+	_bodyLimit = 0;
+	_chunked = false;
+	_chunkState = CHUNK_SIZE;
+	_chunkRemaining = 0;
+	if (_bodyFd != -1)
+	{
+		close(_bodyFd);
+		unlink(_bodyPath.c_str());
+		_bodyFd = -1;
+		_bodyPath.clear();
+	}
+}
 
-	size_t header_end_pos = rawRequest.find("\r\n\r\n");
+requestParser::State requestParser::getState() const
+{
+	return _state;
+}
 
-	if (header_end_pos == std::string::npos)
+bool requestParser::isComplete() const
+{
+	return _state == COMPLETE || _state == ERROR;
+}
+
+bool requestParser::hasError() const
+{
+	return _state == ERROR;
+}
+
+int requestParser::getErrorStatus() const
+{
+	return _errorStatus;
+}
+
+size_t requestParser::getContentLength() const
+{
+	return _contentLength;
+}
+
+bool requestParser::isChunked() const
+{
+	return _chunked;
+}
+
+void requestParser::fail(int status)
+{
+	_state = ERROR;
+	_errorStatus = status;
+}
+
+void requestParser::beginBody(size_t bodyBufferSize, size_t bodyLimit)
+{
+	if (_state != HEADERS_COMPLETE)
+		return;
+	_bodyBufferSize = bodyBufferSize;
+	_bodyLimit = bodyLimit;
+	_state = BODY;
+}
+
+// Moves what has been buffered so far into a temporary file; every later body
+// byte is appended to that file instead of the heap.
+bool requestParser::spoolBody()
+{
+	char path[32];
+	std::strcpy(path, BODY_TEMP_TEMPLATE);
+	_bodyFd = mkstemp(path);
+	if (_bodyFd == -1)
+		return false;
+	_bodyPath = path;
+	fcntl(_bodyFd, F_SETFD, FD_CLOEXEC);
+
+	bool ok = appendBody(_body.data(), _body.size());
+	std::string().swap(_body);
+	return ok;
+}
+
+bool requestParser::appendBody(const char *data, size_t len)
+{
+	if (_bodyFd == -1)
+	{
+		if (_body.size() + len <= _bodyBufferSize)
+		{
+			_body.append(data, len);
+			return true;
+		}
+		if (!spoolBody())
+			return false;
+	}
+
+	while (len > 0)
+	{
+		ssize_t written = write(_bodyFd, data, len);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += written;
+		len -= written;
+	}
+	return true;
+}
+
+// Consumes as many bytes of data as the current state allows and returns how
+// many were used. An incomplete header line is left unconsumed; the caller
+// hands it back together with the next read.
+size_t requestParser::feed(const char *data, size_t len)
+{
+	size_t pos = 0;
+
+	while (pos < len && (_state == REQUEST_LINE || _state == HEADERS))
 	{
-		std::istringstream iss_headers(rawRequest);
-		std::string line;
+		const char *start = data + pos;
+		size_t avail = len - pos;
+		const char *nl = static_cast<const char *>(memchr(start + _lineScanned, '\n', avail - _lineScanned));
+		if (!nl)
+		{
+			_lineScanned = avail;
+			if (_headerSize + avail > MAX_HEADER_SIZE)
+				fail(400);
+			return pos;
+		}
+
+		size_t lineLen = nl - start;
+		pos += lineLen + 1;
+		_lineScanned = 0;
+		_headerSize += lineLen + 1;
+		if (_headerSize > MAX_HEADER_SIZE)
+		{
+			fail(400);
+			return pos;
+		}
+		if (lineLen > 0 && start[lineLen - 1] == '\r')
+			--lineLen;
 
-		if (std::getline(iss_headers, line) && !line.empty())
+		if (_state == REQUEST_LINE)
 		{
-			std::istringstream line_iss(line);
-			line_iss >> _method >> _path >> _httpVersion;
+			// Stray empty lines before a request are allowed (RFC 7230 3.5)
+			if (lineLen == 0)
+				continue;
+			if (!parseRequestLine(start, lineLen))
+				fail(400);
+			else
+				_state = HEADERS;
 		}
+		else if (lineLen == 0)
+		{
+			int status = finishHeaders();
+			if (status != 0)
+				fail(status);
+		}
+		else if (!parseHeaderLine(start, lineLen))
+			fail(400);
+	}
 
-		while (std::getline(iss_headers, line) && line != "\r" && !line.empty())
+	if (_state == BODY && _chunked)
+		pos += feedChunked(data + pos, len - pos);
+	else if (_state == BODY && pos < len)
+	{
+		size_t take = std::min(len - pos, _contentLength - _bodySize);
+		if (!appendBody(data + pos, take))
+		{
+			fail(500);
+			return pos;
+		}
+		_bodySize += take;
+		pos += take;
+		if (_bodySize == _contentLength)
+			_state = COMPLETE;
+	}
+	return pos;
+}
+
+// Decodes the chunked transfer coding: size lines (extensions ignored), data
+// appended to the body as it arrives, and trailer fields, which are dropped.
+// Like the head, an incomplete line is left for the next call.
+size_t requestParser::feedChunked(const char *data, size_t len)
+{
+	size_t pos = 0;
+
+	while (pos < len && _state == BODY)
+	{
+		if (_chunkState == CHUNK_DATA)
 		{
-			if (!line.empty() && line[line.length() - 1] == '\r')
+			size_t take = std::min(len - pos, _chunkRemaining);
+			if (!appendBody(data + pos, take))
 			{
-				line = line.substr(0, line.length() - 1);
+				fail(500);
+				return pos;
 			}
+			_bodySize += take;
+			_chunkRemaining -= take;
+			pos += take;
+			if (_chunkRemaining == 0)
+				_chunkState = CHUNK_DATA_END;
+			continue;
+		}
+
+		const char *start = data + pos;
+		size_t avail = len - pos;
+		const char *nl = static_cast<const char *>(memchr(start + _lineScanned, '\n', avail - _lineScanned));
+		size_t limit = MAX_CHUNK_LINE;
+		if (_chunkState == CHUNK_TRAILER)
+			limit = _headerSize < MAX_HEADER_SIZE ? MAX_HEADER_SIZE - _headerSize : 0;
+		if (!nl)
+		{
+			_lineScanned = avail;
+			if (avail > limit)
+				fail(400);
+			return pos;
+		}
+
+		size_t lineLen = nl - start;
+		pos += lineLen + 1;
+		_lineScanned = 0;
+		if (lineLen + 1 > limit)
+		{
+			fail(400);
+			return pos;
+		}
+		if (lineLen > 0 && start[lineLen - 1] == '\r')
+			--lineLen;
 
-			size_t colon_pos = line.find(':');
-			if (colon_pos != std::string::npos)
+		if (_chunkState == CHUNK_SIZE)
+		{
+			if (!parseChunkSize(start, lineLen))
+				return pos;
+		}
+		else if (_chunkState == CHUNK_DATA_END)
+		{
+			if (lineLen != 0)
+				fail(400);
+			_chunkState = CHUNK_SIZE;
+		}
+		else
+		{
+			_headerSize += lineLen + 1;
+			if (lineLen == 0)
 			{
-				std::string key = line.substr(0, colon_pos);
-				std::string value = line.substr(colon_pos + 1);
-				key.erase(0, key.find_first_not_of(" \t"));
-				key.erase(key.find_last_not_of(" \t") + 1);
-				value.erase(0, value.find_first_not_of(" \t"));
-				value.erase(value.find_last_not_of(" \t") + 1);
-				_headers[key] = value;
+				_contentLength = _bodySize;
+				_state = COMPLETE;
 			}
 		}
-		_body.clear(); // No body if double CRLF not found
-		return;
+	}
+	return pos;
+}
+
+// A chunk that would take the decoded body past the limit is refused before
+// any of it is read.
+bool requestParser::parseChunkSize(const char *line, size_t len)
+{
+	size_t size = 0;
+	size_t i = 0;
+	for (; i < len && std::isxdigit(static_cast<unsigned char>(line[i])); ++i)
+	{
+		if (size > (static_cast<size_t>(-1) >> 4))
+		{
+			fail(413);
+			return false;
+		}
+		int digit = std::isdigit(static_cast<unsigned char>(line[i])) ? line[i] - '0' : std::tolower(line[i]) - 'a' + 10;
+		size = size * 16 + digit;
+	}
+	while (i < len && (line[i] == ' ' || line[i] == '\t'))
+		++i;
+	if (i == 0 || (i < len && line[i] != ';'))
+	{
+		fail(400);
+		return false;
+	}
+	if (size > _bodyLimit - _bodySize)
+	{
+		fail(413);
+		return false;
 	}
 
-	std::string header_part = rawRequest.substr(0, header_end_pos);
-	_body = rawRequest.substr(header_end_pos + 4); // +4 for \r\n\r\n
+	_chunkRemaining = size;
+	_chunkState = size > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+	return true;
+}
 
-	std::istringstream iss_headers(header_part);
-	std::string line;
+bool requestParser::parseRequestLine(const char *line, size_t len)
+{
+	std::string *parts[3] = {&_method, &_path, &_httpVersion};
+	size_t i = 0;
 
-	if (std::getline(iss_headers, line) && !line.empty())
+	for (int part = 0; part < 3; ++part)
 	{
-		std::istringstream line_iss(line);
-		line_iss >> _method >> _path >> _httpVersion;
+		while (i < len && line[i] == ' ')
+			++i;
+		size_t begin = i;
+		while (i < len && line[i] != ' ')
+			++i;
+		if (i == begin)
+			return false;
+		parts[part]->assign(line + begin, i - begin);
 	}
+	while (i < len && line[i] == ' ')
+		++i;
+	return i == len;
+}
+
+bool requestParser::parseHeaderLine(const char *line, size_t len)
+{
+	const char *colon = static_cast<const char *>(memchr(line, ':', len));
+	if (!colon)
+		return true;
 
-	while (std::getline(iss_headers, line) && line != "\r" && !line.empty())
+	size_t keyBegin = 0;
+	size_t keyEnd = colon - line;
+	size_t valueBegin = keyEnd + 1;
+	size_t valueEnd = len;
+
+	while (keyBegin < keyEnd && (line[keyBegin] == ' ' || line[keyBegin] == '\t'))
+		++keyBegin;
+	while (keyEnd > keyBegin && (line[keyEnd - 1] == ' ' || line[keyEnd - 1] == '\t'))
+		--keyEnd;
+	while (valueBegin < valueEnd && (line[valueBegin] == ' ' || line[valueBegin] == '\t'))
+		++valueBegin;
+	while (valueEnd > valueBegin && (line[valueEnd - 1] == ' ' || line[valueEnd - 1] == '\t'))
+		--valueEnd;
+
+	if (keyBegin == keyEnd)
+		return false;
+	_headers[std::string(line + keyBegin, keyEnd - keyBegin)] = std::string(line + valueBegin, valueEnd - valueBegin);
+	return true;
+}
+
+// Returns 0, or the status to fail the request with. Transfer-Encoding must
+// be exactly chunked: another coding is not implemented, and one sent with
+// Content-Length or by an HTTP/1.0 client could frame the body differently
+// for us and for a proxy in front of us.
+int requestParser::finishHeaders()
+{
+	std::string coding = getHeader("Transfer-Encoding");
+	std::string length = getHeader("Content-Length");
+	if (!coding.empty())
 	{
-		if (!line.empty() && line[line.length() - 1] == '\r')
-		{
-			line = line.substr(0, line.length() - 1);
-		}
+		std::transform(coding.begin(), coding.end(), coding.begin(), ::tolower);
+		if (coding != "chunked")
+			return 501;
+		if (!length.empty() || _httpVersion != "HTTP/1.1")
+			return 400;
+		_chunked = true;
+		_state = HEADERS_COMPLETE;
+		return 0;
+	}
 
-		size_t colon_pos = line.find(':');
-		if (colon_pos != std::string::npos)
-		{
-			std::string key = line.substr(0, colon_pos);
-			std::string value = line.substr(colon_pos + 1);
-			key.erase(0, key.find_first_not_of(" \t"));
-			key.erase(key.find_last_not_of(" \t") + 1);
-			value.erase(0, value.find_first_not_of(" \t"));
-			value.erase(value.find_last_not_of(" \t") + 1);
-			_headers[key] = value;
-		}
+	if (length.empty())
+	{
+		_state = COMPLETE;
+		return 0;
 	}
-}
 
+	for (size_t i = 0; i < length.size(); ++i)
+	{
+		if (!std::isdigit(static_cast<unsigned char>(length[i])))
+			return 400;
+	}
+	if (length.size() > 18)
+		return 400;
 
+	_contentLength = std::strtoul(length.c_str(), NULL, 10);
+	_state = _contentLength > 0 ? HEADERS_COMPLETE : COMPLETE;
+	return 0;
+}
 
 const std::string &requestParser::getMethod() const { return _method; }
 const std::string &requestParser::getPath() const { return _path; }
 const std::string &requestParser::getHttpVersion() const { return _httpVersion; }
-const std::map<std::string, std::string> &requestParser::getHeaders() const { return _headers; }
\ No newline at end of file
+const std::map<std::string, std::string> &requestParser::getHeaders() const { return _headers; }
+
+std::string requestParser::getHeader(const std::string &name) const
+{
+	for (std::map<std::string, std::string>::const_iterator it = _headers.begin(); it != _headers.end(); ++it)
+	{
+		if (it->first.size() != name.size())
+			continue;
+		size_t i = 0;
+		while (i < name.size() && std::tolower(it->first[i]) == std::tolower(name[i]))
+			++i;
+		if (i == name.size())
+			return it->second;
+	}
+	return "";
+}
+
+// HTTP/1.1 connections are persistent unless the client sends "Connection: close";
+// HTTP/1.0 connections are closed unless the client asks for "Connection: keep-alive".
+bool requestParser::isKeepAlive() const
+{
+	std::string connection = getHeader("Connection");
+	for (size_t i = 0; i < connection.size(); ++i)
+		connection[i] = std::tolower(connection[i]);
+
+	if (_httpVersion == "HTTP/1.1")
+		return connection.find("close") == std::string::npos;
+	if (_httpVersion == "HTTP/1.0")
+		return connection.find("keep-alive") != std::string::npos;
+	return false;
+}
+
+
+BodyView::BodyView(const requestParser &request) : _data(NULL), _size(request.getBodySize()), _map(NULL)
+{
+	if (!request.isBodyInFile())
+	{
+		_data = request.getBody().data();
+		return;
+	}
+	if (_size == 0)
+		return;
+	_map = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, request.getBodyFd(), 0);
+	if (_map == MAP_FAILED)
+	{
+		_map = NULL;
+		return;
+	}
+	_data = static_cast<const char *>(_map);
+}
+
+BodyView::~BodyView()
+{
+	if (_map)
+		munmap(_map, _size);
+}
+
+bool BodyView::isValid() const
+{
+	return _data != NULL || _size == 0;
+}
+
+const char *BodyView::data() const
+{
+	return _data;
+}
+
+size_t BodyView::size() const
+{
+	return _size;
+}
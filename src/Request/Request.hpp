@@ -2,29 +2,134 @@
 
 #include <map>
 #include <sstream>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
 
 
+// Resumable HTTP/1.x request parser. feed() is called with whatever bytes are
+// available; it consumes complete lines of the request line and headers and
+// then body bytes up to Content-Length, remembering its position between
+// calls, so every byte of a request is examined once no matter how it is split
+// across reads.
+//
+// When a body is announced the parser stops in HEADERS_COMPLETE so the caller
+// can reject it (413) before reading it, then beginBody() resumes parsing.
+// Bodies larger than the body buffer size are spooled to a temporary file.
+// A chunked body is decoded on the way in the same way, so only the data ever
+// reaches memory or the file, and it is refused (413) as soon as its decoded
+// length passes the limit given to beginBody().
 class requestParser
 {
+public:
+    enum State
+    {
+        REQUEST_LINE,
+        HEADERS,
+        HEADERS_COMPLETE,
+        BODY,
+        COMPLETE,
+        ERROR
+    };
+
+    static const size_t MAX_HEADER_SIZE = 16384;
+    static const size_t MAX_CHUNK_LINE = 4096;
+    static const char *const BODY_TEMP_TEMPLATE;
+
 private:
+    enum ChunkState
+    {
+        CHUNK_SIZE,
+        CHUNK_DATA,
+        CHUNK_DATA_END,
+        CHUNK_TRAILER
+    };
+
     std::string _method;
     std::string _path;
     std::string _httpVersion;
     std::map<std::string, std::string> _headers;
     std::string _body;
 
+    State _state;
+    size_t _headerSize;
+    size_t _lineScanned;
+    size_t _contentLength;
+    int _errorStatus;
+
+    size_t _bodySize;
+    size_t _bodyBufferSize;
+    size_t _bodyLimit;
+    bool _chunked;
+    ChunkState _chunkState;
+    size_t _chunkRemaining;
+    int _bodyFd;
+    std::string _bodyPath;
+
+    requestParser(const requestParser &other);
+    requestParser &operator=(const requestParser &other);
+
+    bool parseRequestLine(const char *line, size_t len);
+    bool parseHeaderLine(const char *line, size_t len);
+    int finishHeaders();
+    bool appendBody(const char *data, size_t len);
+    size_t feedChunked(const char *data, size_t len);
+    bool parseChunkSize(const char *line, size_t len);
+    bool spoolBody();
+    void fail(int status);
+
 public:
     requestParser();
     ~requestParser();
 
-    void parseRequest(const std::string &rawRequest);
+    size_t feed(const char *data, size_t len);
+    void beginBody(size_t bodyBufferSize, size_t bodyLimit);
+    void reset();
+
+    State getState() const;
+    bool isComplete() const;
+    bool hasError() const;
+    int getErrorStatus() const;
+    size_t getContentLength() const;
+    bool isChunked() const;
 
     // Existing getters
     const std::string& getMethod() const;
     const std::string& getPath() const;
     const std::string& getHttpVersion() const;
     const std::map<std::string, std::string>& getHeaders() const;
+    std::string getHeader(const std::string& name) const;
+    bool isKeepAlive() const;
 
     const std::string& getBody() const;
     void setBody(const std::string& body);
-};
\ No newline at end of file
+    size_t getBodySize() const;
+    bool isBodyInFile() const;
+    int getBodyFd() const;
+    const std::string& getBodyPath() const;
+};
+
+// Read-only view of a request body wherever it is stored. A spooled body is
+// mmap'd for the lifetime of the view instead of being read back into memory.
+class BodyView
+{
+private:
+    const char *_data;
+    size_t _size;
+    void *_map;
+
+    BodyView(const BodyView &other);
+    BodyView &operator=(const BodyView &other);
+
+public:
+    explicit BodyView(const requestParser &request);
+    ~BodyView();
+
+    bool isValid() const;
+    const char *data() const;
+    size_t size() const;
+};
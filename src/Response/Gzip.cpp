@@ -0,0 +1,178 @@
+#include "Gzip.hpp"
+#include "Response.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <unistd.h>
+
+// windowBits above 15 selects the gzip wrapper instead of zlib's.
+static const int GZIP_WINDOW_BITS = 15 + 16;
+static const int GZIP_MEM_LEVEL = 8;
+
+static bool initDeflate(z_stream &stream)
+{
+    std::memset(&stream, 0, sizeof(stream));
+    return deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL,
+                        Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+// True if the Accept-Encoding header allows the given content coding: listed
+// (gzip also as x-gzip), or covered by "*", with a non-zero q value.
+bool Gzip::accepted(const std::string &acceptEncoding, const std::string &name)
+{
+    bool wildcard = false;
+    std::istringstream list(acceptEncoding);
+    std::string item;
+    while (std::getline(list, item, ','))
+    {
+        size_t semicolon = item.find(';');
+        std::string coding = item.substr(0, semicolon);
+        size_t start = coding.find_first_not_of(" \t");
+        size_t end = coding.find_last_not_of(" \t");
+        coding = start == std::string::npos ? "" : coding.substr(start, end - start + 1);
+        std::transform(coding.begin(), coding.end(), coding.begin(), ::tolower);
+
+        double q = 1;
+        if (semicolon != std::string::npos)
+        {
+            size_t param = item.find("q=", semicolon);
+            if (param != std::string::npos)
+                q = std::strtod(item.c_str() + param + 2, NULL);
+        }
+
+        if (coding == name || (name == "gzip" && coding == "x-gzip"))
+            return q > 0;
+        if (coding == "*")
+            wildcard = q > 0;
+    }
+    return wildcard;
+}
+
+bool Gzip::compress(const std::string &input, std::string &output)
+{
+    z_stream stream;
+    if (!initDeflate(stream))
+        return false;
+
+    output.resize(deflateBound(&stream, input.size()));
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    stream.avail_in = input.size();
+    stream.next_out = reinterpret_cast<Bytef *>(&output[0]);
+    stream.avail_out = output.size();
+
+    int status = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return status == Z_STREAM_END;
+}
+
+GzipEncoder::GzipEncoder() : _ready(false)
+{
+    _ready = initDeflate(_stream);
+}
+
+GzipEncoder::~GzipEncoder()
+{
+    if (_ready)
+        deflateEnd(&_stream);
+}
+
+bool GzipEncoder::deflateInto(const char *data, size_t length, int flush, std::string &out)
+{
+    if (!_ready)
+        return false;
+
+    char buffer[GzipStream::INPUT_BLOCK];
+    _stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    _stream.avail_in = length;
+    do
+    {
+        _stream.next_out = reinterpret_cast<Bytef *>(buffer);
+        _stream.avail_out = sizeof(buffer);
+        int status = deflate(&_stream, flush);
+        if (status == Z_STREAM_ERROR)
+            return false;
+        out.append(buffer, sizeof(buffer) - _stream.avail_out);
+    } while (_stream.avail_out == 0);
+    return true;
+}
+
+bool GzipEncoder::write(const char *data, size_t length, std::string &out)
+{
+    return length == 0 || deflateInto(data, length, Z_SYNC_FLUSH, out);
+}
+
+bool GzipEncoder::finish(std::string &out)
+{
+    return deflateInto(NULL, 0, Z_FINISH, out);
+}
+
+GzipStream::GzipStream(OpenFile *file, off_t offset, size_t length)
+    : _ready(false), _finished(false), _file(file), _offset(offset), _remaining(length)
+{
+    _file->retain();
+    _ready = initDeflate(_stream);
+}
+
+GzipStream::~GzipStream()
+{
+    if (_ready)
+        deflateEnd(&_stream);
+    _file->release();
+}
+
+bool GzipStream::isFinished() const
+{
+    return _finished;
+}
+
+// Appends the next chunk of compressed data, and the last chunk once the
+// range is exhausted. Input is read until deflate yields some output, since
+// it buffers small amounts internally. Returns false on a read error.
+bool GzipStream::produce(std::string &out)
+{
+    if (!_ready)
+        return false;
+
+    std::string compressed;
+    char input[INPUT_BLOCK];
+    char buffer[INPUT_BLOCK];
+    while (compressed.empty() && !_finished)
+    {
+        ssize_t bytes = 0;
+        if (_remaining > 0)
+        {
+            bytes = pread(_file->getFd(), input, std::min(_remaining, sizeof(input)), _offset);
+            if (bytes == -1 && errno == EINTR)
+                continue;
+            // A file that shrank cannot produce what the headers promised
+            if (bytes <= 0)
+                return false;
+            _offset += bytes;
+            _remaining -= bytes;
+        }
+
+        int flush = _remaining == 0 ? Z_FINISH : Z_NO_FLUSH;
+        _stream.next_in = reinterpret_cast<Bytef *>(input);
+        _stream.avail_in = bytes;
+        do
+        {
+            _stream.next_out = reinterpret_cast<Bytef *>(buffer);
+            _stream.avail_out = sizeof(buffer);
+            int status = deflate(&_stream, flush);
+            if (status == Z_STREAM_ERROR)
+                return false;
+            compressed.append(buffer, sizeof(buffer) - _stream.avail_out);
+            if (status == Z_STREAM_END)
+                _finished = true;
+        } while (_stream.avail_out == 0);
+    }
+
+    if (!compressed.empty())
+        Response::appendChunk(out, compressed.data(), compressed.size());
+    if (_finished)
+        out.append("0\r\n\r\n");
+    return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <zlib.h>
+#include "../Server/OpenFileCache.hpp"
+
+// gzip content coding, as enabled by the gzip directives. accepted() also
+// answers for the br sidecars of brotli_static.
+class Gzip
+{
+public:
+    static bool accepted(const std::string &acceptEncoding, const std::string &name);
+    static bool compress(const std::string &input, std::string &output);
+};
+
+// Compresses a body that is produced piece by piece, such as the output of a
+// streaming CGI script. Each write is flushed so the client can decode
+// everything sent so far without waiting for the rest.
+class GzipEncoder
+{
+public:
+    GzipEncoder();
+    ~GzipEncoder();
+
+    bool write(const char *data, size_t length, std::string &out);
+    bool finish(std::string &out);
+
+private:
+    z_stream _stream;
+    bool _ready;
+
+    bool deflateInto(const char *data, size_t length, int flush, std::string &out);
+
+    GzipEncoder(const GzipEncoder &);
+    GzipEncoder &operator=(const GzipEncoder &);
+};
+
+// Compresses a range of an open file piece by piece while the response is
+// sent, so large files are never held in memory. The output is framed with
+// the chunked transfer coding, ending with the last chunk.
+class GzipStream
+{
+public:
+    static const size_t INPUT_BLOCK = 32 * 1024;
+
+    GzipStream(OpenFile *file, off_t offset, size_t length);
+    ~GzipStream();
+
+    bool produce(std::string &out);
+    bool isFinished() const;
+
+private:
+    z_stream _stream;
+    bool _ready;
+    bool _finished;
+    OpenFile *_file;
+    off_t _offset;
+    size_t _remaining;
+
+    GzipStream(const GzipStream &);
+    GzipStream &operator=(const GzipStream &);
+};
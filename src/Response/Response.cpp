@@ -1,6 +1,8 @@
 #include "Response.hpp"
+#include <iomanip>
 
-Response::Response() : statusCode(200), statusMessage("OK"), _httpVersion("HTTP/1.1")
+Response::Response() : statusCode(200), statusMessage("OK"), _httpVersion("HTTP/1.1"),
+                       _file(NULL), _gzipStream(false), _cached(NULL), _prerendered(NULL)
 {
     addHeader("Server", "Webserv/1.0");
     addHeader("Connection", "close");
@@ -25,6 +27,106 @@ void Response::setBody(const std::string &body)
     _body = body;
 }
 
+// The file is borrowed from the open file cache; queueing the response takes
+// the reference that keeps it open while it is sent.
+void Response::setFileBody(OpenFile *file, off_t offset, size_t length)
+{
+    _file = file;
+    _fileRanges.clear();
+    _fileTrailer.clear();
+    _gzipStream = false;
+    addFileRange("", offset, length);
+}
+
+// The whole file, compressed while it is sent with the chunked transfer
+// coding.
+void Response::setGzipBody(OpenFile *file, size_t length)
+{
+    setFileBody(file, 0, length);
+    _gzipStream = true;
+}
+
+bool Response::isGzipStream() const
+{
+    return _gzipStream;
+}
+
+// Compresses a body built in memory, such as an autoindex page or the
+// output of a CGI script, if the server's gzip settings and the request
+// allow it.
+void Response::applyGzip(const requestParser &request, const ConfigParser::ServerConfig &serverConfig)
+{
+    if (statusCode != 200 || _file || _cached || _prerendered || _headers.count("Content-Encoding"))
+        return;
+    std::map<std::string, std::string>::const_iterator type = _headers.find("Content-Type");
+    if (type == _headers.end() || !gzipEligible(serverConfig, type->second, _body.size()))
+        return;
+
+    _headers["Vary"] = "Accept-Encoding";
+    std::string compressed;
+    if (!Gzip::accepted(request.getHeader("Accept-Encoding"), "gzip") || !Gzip::compress(_body, compressed))
+        return;
+    _body.swap(compressed);
+    _headers["Content-Encoding"] = "gzip";
+    _headers.erase("Content-Length");
+}
+
+void Response::addFileRange(const std::string &prefix, off_t offset, size_t length)
+{
+    FileRange range;
+    range.prefix = prefix;
+    range.offset = offset;
+    range.length = length;
+    _fileRanges.push_back(range);
+}
+
+void Response::setFileTrailer(const std::string &trailer)
+{
+    _fileTrailer = trailer;
+}
+
+// The body and entity headers come from the static cache; like a file
+// body, the item is borrowed until the response is queued.
+void Response::setCachedBody(StaticCache::Item *item)
+{
+    _cached = item;
+}
+
+StaticCache::Item *Response::getCachedBody() const
+{
+    return _cached;
+}
+
+bool Response::hasFileBody() const
+{
+    return _file != NULL;
+}
+
+OpenFile *Response::getFile() const
+{
+    return _file;
+}
+
+const std::vector<Response::FileRange> &Response::getFileRanges() const
+{
+    return _fileRanges;
+}
+
+const std::string &Response::getFileTrailer() const
+{
+    return _fileTrailer;
+}
+
+bool Response::isPrerendered() const
+{
+    return _prerendered != NULL;
+}
+
+const std::string &Response::getPrerendered(bool keep_alive) const
+{
+    return keep_alive ? _prerendered->keep_alive : _prerendered->close;
+}
+
 void Response::setHttpVersion(const std::string &version)
 {
     _httpVersion = version;
@@ -55,27 +157,267 @@ const std::string &Response::getHttpVersion() const
     return _httpVersion;
 }
 
-std::string Response::toString() const
+static void appendNumber(std::string &out, size_t value)
 {
-    std::ostringstream oss;
+    char digits[24];
+    size_t pos = sizeof(digits);
+    do
+    {
+        digits[--pos] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    out.append(digits + pos, sizeof(digits) - pos);
+}
 
-    oss << _httpVersion << " " << statusCode << " " << statusMessage << "\r\n";
+// Appends the status line and headers, up to and including the blank line,
+// straight into out (normally a pooled per-connection buffer).
+void Response::serializeHead(std::string &out) const
+{
+    out.append(_httpVersion);
+    out += ' ';
+    appendNumber(out, statusCode);
+    out += ' ';
+    out.append(statusMessage);
+    out.append("\r\n", 2);
 
     for (std::map<std::string, std::string>::const_iterator it = _headers.begin(); it != _headers.end(); ++it)
     {
-        oss << it->first << ": " << it->second << "\r\n";
+        out.append(it->first);
+        out.append(": ", 2);
+        out.append(it->second);
+        out.append("\r\n", 2);
     }
 
-    if (_body.length() > 0 && _headers.find("Content-Length") == _headers.end())
+    if (_cached)
+    {
+        out.append(_cached->headers);
+    }
+    else if (_headers.find("Content-Length") == _headers.end() && _headers.find("Transfer-Encoding") == _headers.end() &&
+             statusCode != 304)
     {
-        oss << "Content-Length: " << to_string_c98(_body.length()) << "\r\n";
+        out.append("Content-Length: ");
+        appendNumber(out, _body.length());
+        out.append("\r\n", 2);
     }
 
-    oss << "\r\n";
+    out.append("\r\n", 2);
+}
 
-    oss << _body;
+// Frames data as one chunk of the chunked transfer coding. An empty chunk
+// would end the body, so nothing is appended for one.
+void Response::appendChunk(std::string &out, const char *data, size_t length)
+{
+    if (length == 0)
+        return;
+    std::ostringstream size;
+    size << std::hex << length;
+    out.append(size.str());
+    out.append("\r\n", 2);
+    out.append(data, length);
+    out.append("\r\n", 2);
+}
 
-    return oss.str();
+std::string Response::toString() const
+{
+    std::string out;
+    serializeHead(out);
+    out.append(_body);
+    return out;
+}
+
+// Lets the caller take the body over (by swapping) instead of copying it.
+std::string &Response::releaseBody()
+{
+    return _body;
+}
+
+// Error pages are rendered once per server block by prerenderServer(); this
+// only falls back to reading the page from disk for codes not rendered there.
+Response Response::buildErrorResponse(int status_code, const std::string &message, const ConfigParser::ServerConfig &serverConfig)
+{
+    std::map<int, ConfigParser::Prerendered>::const_iterator it = serverConfig.error_responses.find(status_code);
+    if (it == serverConfig.error_responses.end())
+        return renderErrorResponse(status_code, message, serverConfig);
+
+    return buildPrerendered(status_code, message, it->second);
+}
+
+Response Response::renderErrorResponse(int status_code, const std::string &message, const ConfigParser::ServerConfig &serverConfig)
+{
+    std::string status_text;
+    std::string error_page_path;
+
+    switch (status_code)
+    {
+    case 400:
+        status_text = "Bad Request";
+        break;
+    case 403:
+        status_text = "Forbidden";
+        break;
+    case 404:
+        status_text = "Not Found";
+        break;
+    case 405:
+        status_text = "Method Not Allowed";
+        break;
+    case 408:
+        status_text = "Request Timeout";
+        break;
+    case 413:
+        status_text = "Payload Too Large";
+        break;
+    case 416:
+        status_text = "Range Not Satisfiable";
+        break;
+    case 500:
+        status_text = "Internal Server Error";
+        break;
+    case 501:
+        status_text = "Not Implemented";
+        break;
+    case 502:
+        status_text = "Bad Gateway";
+        break;
+    case 504:
+        status_text = "Gateway Timeout";
+        break;
+    case 505:
+        status_text = "HTTP Version Not Supported";
+        break;
+    default:
+        status_text = "Error";
+        break;
+    }
+
+    std::map<int, std::string>::const_iterator it = serverConfig.error_pages.find(status_code);
+    if (it != serverConfig.error_pages.end())
+    {
+        error_page_path = serverConfig.root + it->second;
+    }
+    else
+    {
+        if (status_code == 404)
+            error_page_path = "./www/epages/404.html";
+        else if (status_code == 500)
+            error_page_path = "./www/epages/500.html";
+        else if (status_code == 403)
+            error_page_path = "./www/epages/403.html";
+        else if (status_code == 400)
+            error_page_path = "./www/epages/400.html";
+        else if (status_code == 405)
+            error_page_path = "./www/epages/405.html";
+        else if (status_code == 408)
+            error_page_path = "./www/epages/408.html";
+        else if (status_code == 413)
+            error_page_path = "./www/epages/413.html";
+        else if (status_code == 416)
+            error_page_path = "./www/epages/416.html";
+        else if (status_code == 501)
+            error_page_path = "./www/epages/501.html";
+        else if (status_code == 502)
+            error_page_path = "./www/epages/502.html";
+        else if (status_code == 504)
+            error_page_path = "./www/epages/504.html";
+        else if (status_code == 505)
+            error_page_path = "./www/epages/505.html";
+        else
+            error_page_path = "./www/epages/500.html";
+    }
+
+    std::string response_body = "";
+
+    int error_fd = open(error_page_path.c_str(), O_RDONLY);
+    if (error_fd >= 0)
+    {
+        struct stat st;
+        if (fstat(error_fd, &st) == 0 && st.st_size > 0)
+        {
+            response_body.resize(st.st_size);
+            ssize_t bytesRead = read(error_fd, &response_body[0], st.st_size);
+            if (bytesRead <= 0 || response_body.find_first_not_of(" \t\n\r") == std::string::npos)
+            {
+                response_body = "<!DOCTYPE html><html><head><title>Error " + to_string_c98(status_code) +
+                                "</title></head><body><h1>Error " + to_string_c98(status_code) + ": " +
+                                status_text + "</h1><p>" + (message.empty() ? status_text : message) + "</p></body></html>";
+            }
+        }
+        else
+        {
+            response_body = "<!DOCTYPE html><html><head><title>Error " + to_string_c98(status_code) +
+                            "</title></head><body><h1>Error " + to_string_c98(status_code) + ": " +
+                            status_text + "</h1><p>" + (message.empty() ? status_text : message) + "</p></body></html>";
+        }
+        close(error_fd);
+    }
+    else
+    {
+        response_body = "<!DOCTYPE html><html><head><title>Error " + to_string_c98(status_code) +
+                        "</title></head><body><h1>Error " + to_string_c98(status_code) + ": " +
+                        status_text + "</h1><p>" + (message.empty() ? status_text : message) + "</p></body></html>";
+    }
+
+    Response response;
+    response.setStatus(status_code, status_text);
+    response.addHeader("Content-Type", "text/html");
+    response.setBody(response_body);
+    return response;
+}
+
+Response Response::buildRedirectResponse(int status_code, const std::string &location_url, const std::string &status_text)
+{
+    std::string response_body = "<!DOCTYPE html><html><head><title>" + to_string_c98(status_code) + " " + status_text +
+                                "</title></head><body><h1>" + status_text + "</h1><p>The document has moved <a href=\"" +
+                                location_url + "\">here</a>.</p></body></html>";
+
+    Response response;
+    response.setStatus(status_code, status_text);
+    response.addHeader("Location", location_url);
+    response.addHeader("Content-Type", "text/html");
+    response.setBody(response_body);
+    return response;
+}
+
+Response Response::buildPrerendered(int status_code, const std::string &status_text, const ConfigParser::Prerendered &prerendered)
+{
+    Response response;
+    response.setStatus(status_code, status_text);
+    response._prerendered = &prerendered;
+    return response;
+}
+
+void Response::prerender(const Response &response, ConfigParser::Prerendered &out)
+{
+    Response variant = response;
+    variant.addHeader("Connection", "close");
+    out.close = variant.toString();
+    variant.addHeader("Connection", "keep-alive");
+    out.keep_alive = variant.toString();
+}
+
+// Serializes the server's error pages (the built-in ones plus every
+// error_page entry) and its locations' redirects, so that sending one is a
+// single buffer enqueue instead of disk I/O on the event loop.
+void Response::prerenderServer(ConfigParser::ServerConfig &serverConfig)
+{
+    static const int builtin[] = {400, 403, 404, 405, 408, 413, 416, 500, 501, 502, 504, 505};
+    std::set<int> codes(builtin, builtin + sizeof(builtin) / sizeof(builtin[0]));
+    for (std::map<int, std::string>::const_iterator it = serverConfig.error_pages.begin(); it != serverConfig.error_pages.end(); ++it)
+        codes.insert(it->first);
+
+    serverConfig.error_responses.clear();
+    for (std::set<int>::const_iterator it = codes.begin(); it != codes.end(); ++it)
+    {
+        Response response = renderErrorResponse(*it, "", serverConfig);
+        prerender(response, serverConfig.error_responses[*it]);
+    }
+
+    for (size_t i = 0; i < serverConfig.locations.size(); ++i)
+    {
+        ConfigParser::LocationConfig &location = serverConfig.locations[i];
+        if (!location.return_directive.empty())
+            prerender(buildRedirectResponse(302, location.return_directive, "Found"), location.redirect_response);
+    }
 }
 
 std::string urlDecode(const std::string &str)
@@ -147,35 +489,331 @@ std::string Response::getContentType(const std::string &filePath)
         return (unknown);
 }
 
-Response Response::buildFileResponse(const std::string &filePath, const ConfigParser::ServerConfig &serverConfig, int client_fd)
+std::string Response::httpDate(time_t when)
+{
+    char buffer[64];
+    struct tm tm;
+    gmtime_r(&when, &tm);
+    strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buffer;
+}
+
+// Weak, since a file rewritten within the same second keeps its tag: hex
+// inode, mtime and size.
+std::string Response::entityTag(const OpenFileCache::Entry &file)
+{
+    std::ostringstream oss;
+    oss << "W/\"" << std::hex << static_cast<unsigned long>(file.inode) << "-"
+        << static_cast<unsigned long>(file.mtime) << "-" << static_cast<unsigned long>(file.size) << "\"";
+    return oss.str();
+}
+
+// Weak comparison against an If-None-Match list: "W/" prefixes are ignored
+// and "*" matches any existing file.
+static bool matchesEntityTag(const std::string &header, const std::string &etag)
+{
+    std::string tag = etag.compare(0, 2, "W/") == 0 ? etag.substr(2) : etag;
+    size_t pos = 0;
+    while (pos < header.size())
+    {
+        size_t end = header.find(',', pos);
+        if (end == std::string::npos)
+            end = header.size();
+        size_t first = header.find_first_not_of(" \t", pos);
+        size_t last = header.find_last_not_of(" \t", end - 1);
+        if (first != std::string::npos && first < end && last >= first)
+        {
+            std::string candidate = header.substr(first, last - first + 1);
+            if (candidate.compare(0, 2, "W/") == 0)
+                candidate.erase(0, 2);
+            if (candidate == "*" || candidate == tag)
+                return true;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+// RFC 9110 13.2.2: If-None-Match wins over If-Modified-Since, and an
+// unparsable date is ignored.
+bool Response::isNotModified(const requestParser &request, const OpenFileCache::Entry &file)
+{
+    std::string ifNoneMatch = request.getHeader("If-None-Match");
+    if (!ifNoneMatch.empty())
+        return matchesEntityTag(ifNoneMatch, entityTag(file));
+
+    std::string ifModifiedSince = request.getHeader("If-Modified-Since");
+    if (ifModifiedSince.empty())
+        return false;
+    if (ifModifiedSince == httpDate(file.mtime))
+        return true;
+
+    struct tm tm;
+    std::memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(ifModifiedSince.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0')
+        return false;
+    return file.mtime <= timegm(&tm);
+}
+
+// A Range is only honoured if If-Range still names the current file: an
+// entity tag must match strongly (so never one of our weak tags), a date
+// exactly.
+bool Response::ifRangeMatches(const requestParser &request, const OpenFileCache::Entry &file)
 {
-    if (!fileExists(filePath))
+    std::string ifRange = request.getHeader("If-Range");
+    if (ifRange.empty())
+        return true;
+    if (ifRange[0] == '"' || ifRange.compare(0, 2, "W/") == 0)
+        return ifRange.compare(0, 2, "W/") != 0 && ifRange == entityTag(file);
+    return ifRange == httpDate(file.mtime);
+}
+
+// Parses "bytes=a-b, c-, -n" into inclusive ranges clipped to the file.
+// Returns false if the header is malformed, in which case it is ignored;
+// ranges is left empty when none of them is satisfiable.
+bool Response::parseRanges(const std::string &header, off_t size, std::vector<std::pair<off_t, off_t> > &ranges)
+{
+    static const size_t MAX_RANGES = 16;
+
+    if (header.compare(0, 6, "bytes=") != 0)
+        return false;
+
+    std::istringstream specs(header.substr(6));
+    std::string spec;
+    size_t count = 0;
+    while (std::getline(specs, spec, ','))
     {
-        std::cerr << "ERROR: File not found: " << filePath << std::endl;
-        send_error_response(client_fd, 404, "Not Found", serverConfig);
-        return Response();
+        spec.erase(0, spec.find_first_not_of(" \t"));
+        spec.erase(spec.find_last_not_of(" \t") + 1);
+        size_t dash = spec.find('-');
+        if (dash == std::string::npos || ++count > MAX_RANGES)
+            return false;
+
+        std::string first = spec.substr(0, dash);
+        std::string last = spec.substr(dash + 1);
+        if ((first.empty() && last.empty()) ||
+            first.find_first_not_of("0123456789") != std::string::npos ||
+            last.find_first_not_of("0123456789") != std::string::npos ||
+            first.size() > 18 || last.size() > 18)
+            return false;
+
+        off_t start;
+        off_t end;
+        if (first.empty())
+        {
+            off_t suffix = std::strtoll(last.c_str(), NULL, 10);
+            if (suffix == 0 || size == 0)
+                continue;
+            start = suffix < size ? size - suffix : 0;
+            end = size - 1;
+        }
+        else
+        {
+            start = std::strtoll(first.c_str(), NULL, 10);
+            end = last.empty() ? start : std::strtoll(last.c_str(), NULL, 10);
+            if (end < start)
+                return false;
+            if (start >= size)
+                continue;
+            if (last.empty() || end >= size)
+                end = size - 1;
+        }
+        ranges.push_back(std::make_pair(start, end));
+    }
+    return count > 0;
+}
+
+// 206 with the single range streamed by sendfile() at its offset, or a
+// multipart/byteranges body whose parts are file slices between part headers.
+Response Response::buildRangeResponse(const std::string &filePath, const OpenFileCache::Entry &file, const std::vector<std::pair<off_t, off_t> > &ranges, const ConfigParser::ServerConfig &serverConfig)
+{
+    std::string total = to_string_c98(file.size);
+
+    if (ranges.empty())
+    {
+        Response response = renderErrorResponse(416, "Range Not Satisfiable", serverConfig);
+        response.addHeader("Content-Range", "bytes */" + total);
+        return response;
     }
 
-    std::ifstream file(filePath.c_str(), std::ios::binary);
-    if (!file.is_open())
+    Response response;
+    response.setStatus(206, "Partial Content");
+    response.addHeader("ETag", entityTag(file));
+    response.addHeader("Last-Modified", httpDate(file.mtime));
+    response.addHeader("Accept-Ranges", "bytes");
+
+    if (ranges.size() == 1)
     {
-        std::cerr << "ERROR: Could not open file: " << filePath << std::endl;
-        send_error_response(client_fd, 500, "Internal Server Error", serverConfig);
-        return Response();
+        off_t length = ranges[0].second - ranges[0].first + 1;
+        response.addHeader("Content-Type", getContentType(filePath));
+        response.addHeader("Content-Range", "bytes " + to_string_c98(ranges[0].first) + "-" + to_string_c98(ranges[0].second) + "/" + total);
+        response.addHeader("Content-Length", to_string_c98(length));
+        response.setFileBody(file.file, ranges[0].first, length);
+        return response;
     }
 
-    file.seekg(0, std::ios::end);
-    size_t fileSize = file.tellg();
-    file.seekg(0, std::ios::beg);
+    static unsigned long sequence = static_cast<unsigned long>(time(NULL));
+    std::ostringstream boundary;
+    boundary << std::setw(20) << std::setfill('0') << ++sequence;
+
+    std::string contentType = getContentType(filePath);
+    size_t length = 0;
+    response._file = file.file;
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+        std::string prefix = std::string(i ? "\r\n" : "") + "--" + boundary.str() + "\r\n" +
+                             "Content-Type: " + contentType + "\r\n" +
+                             "Content-Range: bytes " + to_string_c98(ranges[i].first) + "-" + to_string_c98(ranges[i].second) + "/" + total + "\r\n\r\n";
+        size_t slice = ranges[i].second - ranges[i].first + 1;
+        response.addFileRange(prefix, ranges[i].first, slice);
+        length += prefix.size() + slice;
+    }
+    response.setFileTrailer("\r\n--" + boundary.str() + "--\r\n");
+    length += response.getFileTrailer().size();
 
-    std::string content(fileSize, '\0');
-    file.read(&content[0], fileSize);
-    file.close();
+    response.addHeader("Content-Type", "multipart/byteranges; boundary=" + boundary.str());
+    response.addHeader("Content-Length", to_string_c98(length));
+    return response;
+}
 
+Response Response::buildNotModifiedResponse(const OpenFileCache::Entry &file)
+{
+    Response response;
+    response.setStatus(304, "Not Modified");
+    response.addHeader("ETag", entityTag(file));
+    response.addHeader("Last-Modified", httpDate(file.mtime));
+    return response;
+}
+
+// The headers describing the file itself, serialized once per cached file.
+std::string Response::entityHeaders(const std::string &filePath, const OpenFileCache::Entry &file)
+{
+    return "Content-Length: " + to_string_c98(file.size) + "\r\n" +
+           "Content-Type: " + getContentType(filePath) + "\r\n" +
+           "ETag: " + entityTag(file) + "\r\n" +
+           "Last-Modified: " + httpDate(file.mtime) + "\r\n" +
+           "Accept-Ranges: bytes\r\n";
+}
+
+// Whether gzip applies to a body of this type and length; the media type is
+// compared without its parameters.
+bool Response::gzipEligible(const ConfigParser::ServerConfig &serverConfig, const std::string &contentType, size_t length)
+{
+    if (!serverConfig.gzip || length < serverConfig.gzip_min_length)
+        return false;
+    std::string type = contentType.substr(0, contentType.find(';'));
+    type.erase(type.find_last_not_of(" \t") + 1);
+    std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+    return serverConfig.gzip_types.count(type) || serverConfig.gzip_types.count("*");
+}
+
+// The compressed variant of a small file is kept in the gzip cache, which
+// matches it against the file's inode, size and mtime like the static cache.
+// Larger files are compressed while they are sent, which takes the chunked
+// transfer coding and so HTTP/1.1; older clients get the file as is.
+bool Response::buildGzipBody(Response &response, const requestParser &request, const std::string &filePath, const OpenFileCache::Entry &file, StaticCache &gzipCache)
+{
+    StaticCache::Item *item = gzipCache.find(file);
+    if (!item && gzipCache.accepts(file))
+    {
+        std::string body;
+        std::string compressed;
+        if (StaticCache::readBody(file, body) && Gzip::compress(body, compressed))
+        {
+            std::string headers = "Content-Length: " + to_string_c98(compressed.size()) + "\r\n" +
+                                  "Content-Type: " + getContentType(filePath) + "\r\n" +
+                                  "Content-Encoding: gzip\r\n" +
+                                  "ETag: " + entityTag(file) + "\r\n" +
+                                  "Last-Modified: " + httpDate(file.mtime) + "\r\n";
+            item = gzipCache.insert(file, headers, compressed);
+        }
+    }
+    if (item)
+    {
+        response.setCachedBody(item);
+        return true;
+    }
+
+    if (request.getHttpVersion() != "HTTP/1.1")
+        return false;
+    response.addHeader("Content-Type", getContentType(filePath));
+    response.addHeader("Content-Encoding", "gzip");
+    response.addHeader("Transfer-Encoding", "chunked");
+    response.addHeader("ETag", entityTag(file));
+    response.addHeader("Last-Modified", httpDate(file.mtime));
+    response.setGzipBody(file.file, file.size);
+    return true;
+}
+
+// A sidecar compressed ahead of time next to the file (file.br, file.gz) is
+// sent like any other file, with sendfile(), so it costs no CPU per request.
+// Brotli wins when the client takes both. A sidecar older than the file is
+// stale and skipped; a missing one is remembered by the open file cache.
+bool Response::buildPrecompressedResponse(Response &response, const requestParser &request, const std::string &filePath, const OpenFileCache::Entry &file, const ConfigParser::ServerConfig &serverConfig, OpenFileCache &fileCache)
+{
+    static const char *const codings[] = {"br", "gzip"};
+    static const char *const suffixes[] = {".br", ".gz"};
+    const bool enabled[] = {serverConfig.brotli_static, serverConfig.gzip_static};
+
+    // Looking a sidecar up may displace the file's own entry
+    std::string etag = entityTag(file);
+    time_t mtime = file.mtime;
+    std::string acceptEncoding = request.getHeader("Accept-Encoding");
+    for (size_t i = 0; i < 2; ++i)
+    {
+        if (!enabled[i] || !Gzip::accepted(acceptEncoding, codings[i]))
+            continue;
+        const OpenFileCache::Entry &sidecar = fileCache.lookup(filePath + suffixes[i]);
+        if (sidecar.error != 0 || sidecar.is_dir || sidecar.mtime < mtime)
+            continue;
+
+        response.setStatus(200, "OK");
+        response.addHeader("Content-Type", getContentType(filePath));
+        response.addHeader("Content-Encoding", codings[i]);
+        response.addHeader("Content-Length", to_string_c98(sidecar.size));
+        response.addHeader("ETag", etag);
+        response.addHeader("Last-Modified", httpDate(mtime));
+        response.addHeader("Vary", "Accept-Encoding");
+        response.setFileBody(sidecar.file, 0, sidecar.size);
+        return true;
+    }
+    return false;
+}
+
+// Small files are answered from the static cache. Otherwise the body is not
+// read here: the response carries the open descriptor and the Client streams
+// it to the socket with sendfile() once the headers are out.
+Response Response::buildFileResponse(const requestParser &request, const std::string &filePath, const OpenFileCache::Entry &file, const ConfigParser::ServerConfig &serverConfig, StaticCache &staticCache, StaticCache &gzipCache)
+{
     Response response;
     response.setStatus(200, "OK");
+
+    // Both variants are served from the same URL, so caches have to key
+    // them on Accept-Encoding.
+    if (gzipEligible(serverConfig, getContentType(filePath), file.size))
+    {
+        response.addHeader("Vary", "Accept-Encoding");
+        if (Gzip::accepted(request.getHeader("Accept-Encoding"), "gzip") &&
+            buildGzipBody(response, request, filePath, file, gzipCache))
+            return response;
+    }
+
+    StaticCache::Item *item = staticCache.find(file);
+    if (!item && staticCache.accepts(file))
+        item = staticCache.insert(file, entityHeaders(filePath, file));
+    if (item)
+    {
+        response.setCachedBody(item);
+        return response;
+    }
+
     response.addHeader("Content-Type", getContentType(filePath));
-    response.setBody(content);
+    response.addHeader("Content-Length", to_string_c98(file.size));
+    response.addHeader("ETag", entityTag(file));
+    response.addHeader("Last-Modified", httpDate(file.mtime));
+    response.addHeader("Accept-Ranges", "bytes");
+    response.setFileBody(file.file, 0, file.size);
 
     return (response);
 }
@@ -185,40 +823,34 @@ Response Response::buildAutoindexResponse(const std::string &htmlContent)
     Response response;
 
     response.setStatus(200, "OK");
-    std::stringstream headers;
-    headers << "HTTP/1.0 200 OK\r\n";
-    headers << "Content-Type: text/html\r\n";
-    headers << "Content-Length: " << htmlContent.size() << "\r\n";
-    headers << "Connection: close\r\n";
-    headers << "\r\n";
-
     response.addHeader("Content-Type", "text/html");
     response.addHeader("charset", "UTF-8");
     response.addHeader("Content-Length", to_string_c98(htmlContent.size()));
-    response.addHeader("Connection", "close");
     response.setBody(htmlContent);
 
     return response;
 }
 
-Response Response::buildGetResponse(const requestParser &request, const std::string &docRoot, const bool autoindex, int client_fd, const ConfigParser::ServerConfig &serverConfig)
+// Existence, permissions, directory and index resolution and the open
+// descriptor all come from the open file cache, so a cached GET makes no
+// filesystem syscall at all. entry is the caller's lookup of docRoot.
+Response Response::buildGetResponse(const requestParser &request, const std::string &docRoot, const OpenFileCache::Entry &entry, const bool autoindex, const ConfigParser::ServerConfig &serverConfig, OpenFileCache &fileCache, StaticCache &staticCache, StaticCache &gzipCache)
 {
     if (docRoot.empty())
     {
-        send_error_response(client_fd, 404, "Not Found", serverConfig);
-        return Response();
+        return buildErrorResponse(404, "Not Found", serverConfig);
     }
 
     std::string requestPath = request.getPath();
     std::string fullPath = docRoot;
+    const OpenFileCache::Entry *file = &entry;
 
-    if (!fileExists(fullPath))
+    if (file->error == ENOENT || file->error == ENOTDIR)
     {
-        send_error_response(client_fd, 404, "Not Found", serverConfig);
-        return Response();
+        return buildErrorResponse(404, "Not Found", serverConfig);
     }
 
-    if (isDirectory(fullPath))
+    if (file->is_dir)
     {
         if (fullPath[fullPath.length() - 1] != '/')
             fullPath += '/';
@@ -226,7 +858,8 @@ Response Response::buildGetResponse(const requestParser &request, const std::str
         if (!serverConfig.locations.empty() && !serverConfig.locations[0].index.empty())
         {
             std::string indexPath = fullPath + serverConfig.locations[0].index;
-            if (fileExists(indexPath))
+            file = &fileCache.lookup(indexPath);
+            if (file->error != ENOENT && file->error != ENOTDIR)
             {
                 fullPath = indexPath;
             }
@@ -237,71 +870,162 @@ Response Response::buildGetResponse(const requestParser &request, const std::str
             }
             else
             {
-                send_error_response(client_fd, 403, "Forbidden", serverConfig);
-                return Response();
+                return buildErrorResponse(403, "Forbidden", serverConfig);
             }
         }
         else
         {
-            send_error_response(client_fd, 403, "Forbidden", serverConfig);
-            return Response();
+            return buildErrorResponse(403, "Forbidden", serverConfig);
         }
     }
 
-    if (access(fullPath.c_str(), R_OK) != 0)
+    if (file->error == EACCES || file->is_dir)
     {
-        send_error_response(client_fd, 403, "Forbidden", serverConfig);
-        return Response();
+        return buildErrorResponse(403, "Forbidden", serverConfig);
+    }
+    if (file->error != 0)
+    {
+        std::cerr << "ERROR: Could not open file: " << fullPath << std::endl;
+        return buildErrorResponse(500, "Internal Server Error", serverConfig);
     }
 
-    return buildFileResponse(fullPath, serverConfig, client_fd);
+    if (isNotModified(request, *file))
+    {
+        return buildNotModifiedResponse(*file);
+    }
+
+    std::string range = request.getHeader("Range");
+    std::vector<std::pair<off_t, off_t> > ranges;
+    if (!range.empty() && ifRangeMatches(request, *file) && parseRanges(range, file->size, ranges))
+    {
+        return buildRangeResponse(fullPath, *file, ranges, serverConfig);
+    }
+
+    if (serverConfig.brotli_static || serverConfig.gzip_static)
+    {
+        Response response;
+        if (buildPrecompressedResponse(response, request, fullPath, *file, serverConfig, fileCache))
+        {
+            return response;
+        }
+        file = &fileCache.lookup(fullPath);
+        if (file->error != 0 || file->is_dir)
+        {
+            return buildErrorResponse(404, "Not Found", serverConfig);
+        }
+    }
+
+    return buildFileResponse(request, fullPath, *file, serverConfig, staticCache, gzipCache);
 }
 
+// Upload names carry the pid, since the workers of a pre-fork server share
+// the clock, and a per-process counter for requests within one second.
 std::string generateUniqueFilename(const std::string &prefix, const std::string &extension)
 {
-    static bool seeded = false;
-    if (!seeded)
-    {
-        std::srand(static_cast<unsigned int>(time(NULL)));
-        seeded = true;
-    }
+    static unsigned long counter = 0;
 
     std::ostringstream filename;
-    filename << prefix << "_" << time(NULL) << "_" << (std::rand() % 100000) << extension;
+    filename << prefix << "_" << time(NULL) << "_" << getpid() << "_" << counter++ << extension;
     return filename.str();
 }
 
-Response Response::buildPostResponse(const requestParser &request, const std::string &docRoot, int client_fd, const ConfigParser::ServerConfig &serverConfig)
-{
-    std::string requestPath = request.getPath();
-    std::string requestBody = request.getBody();
-    size_t contentLength = 0;
+static const int MAX_NAME_ATTEMPTS = 16;
 
-    std::map<std::string, std::string> headers = request.getHeaders();
-    std::map<std::string, std::string>::iterator it = headers.find("Content-Length");
+// Creates a new file in dir under a fresh name and returns its descriptor, or
+// -1. O_EXCL makes sure an existing upload is never opened, let alone
+// truncated; a name that is taken is simply replaced by the next one.
+static int createUploadFile(const std::string &dir, const std::string &prefix, const std::string &extension,
+                            std::string &fileName)
+{
+    for (int attempt = 0; attempt < MAX_NAME_ATTEMPTS; ++attempt)
+    {
+        fileName = generateUniqueFilename(prefix, extension);
+        int fd = open((dir + "/" + fileName).c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd != -1 || errno != EEXIST)
+            return fd;
+    }
+    return -1;
+}
 
-    if (it != headers.end())
+static bool writeAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
     {
-        std::stringstream ss(it->second);
-        ss >> contentLength;
+        ssize_t written = write(fd, data, length);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        length -= written;
     }
-    if (requestBody.length() > contentLength)
+    return true;
+}
+
+// Writes the request body to a new file in dir and sets fileName to its name.
+// A body spooled to disk is hard-linked or copied in the kernel rather than
+// read back into memory; like O_EXCL, link() fails rather than replace a file.
+bool saveRequestBody(const requestParser &request, const std::string &dir, const std::string &prefix,
+                     const std::string &extension, std::string &fileName)
+{
+    if (request.isBodyInFile())
     {
-        requestBody = requestBody.substr(0, contentLength);
+        for (int attempt = 0; attempt < MAX_NAME_ATTEMPTS; ++attempt)
+        {
+            fileName = generateUniqueFilename(prefix, extension);
+            std::string path = dir + "/" + fileName;
+            if (link(request.getBodyPath().c_str(), path.c_str()) == 0)
+            {
+                chmod(path.c_str(), 0644);
+                return true;
+            }
+            if (errno != EEXIST)
+                break;
+        }
     }
-    if (requestBody.length() < contentLength)
+
+    int out = createUploadFile(dir, prefix, extension, fileName);
+    if (out == -1)
+        return false;
+    bool ok = true;
+    if (request.isBodyInFile())
     {
-        send_error_response(client_fd, 400, "Bad Request", serverConfig);
-        return Response();
+        off_t offset = 0;
+        size_t remaining = request.getBodySize();
+        while (ok && remaining > 0)
+        {
+            ssize_t copied = sendfile(out, request.getBodyFd(), &offset, remaining);
+            ok = copied > 0;
+            if (ok)
+                remaining -= copied;
+        }
     }
-    if (requestBody.empty())
+    else
+        ok = writeAll(out, request.getBody().data(), request.getBody().size());
+    ok = close(out) == 0 && ok;
+    if (!ok)
+        unlink((dir + "/" + fileName).c_str());
+    return ok;
+}
+
+Response Response::buildPostResponse(const requestParser &request, const std::string &docRoot, const ConfigParser::ServerConfig &serverConfig)
+{
+    std::string requestPath = request.getPath();
+    BodyView body(request);
+    if (!body.isValid())
+        return buildErrorResponse(500, "Internal Server Error", serverConfig);
+
+    const char *bodyData = body.data();
+    size_t bodyLength = body.size();
+    const std::map<std::string, std::string> &headers = request.getHeaders();
+
+    if (bodyLength == 0)
     {
-        send_error_response(client_fd, 400, "Bad Request", serverConfig);
-        return Response();
+        return buildErrorResponse(400, "Bad Request", serverConfig);
     }
 
     std::string contentType = "";
-    for (std::map<std::string, std::string>::iterator iter = headers.begin(); iter != headers.end(); ++iter)
+    for (std::map<std::string, std::string>::const_iterator iter = headers.begin(); iter != headers.end(); ++iter)
     {
         std::string keyword = iter->first;
         std::transform(keyword.begin(), keyword.end(), keyword.begin(), ::tolower);
@@ -315,7 +1039,7 @@ Response Response::buildPostResponse(const requestParser &request, const std::st
     if (contentType.find("application/x-www-form-urlencoded") != std::string::npos)
     {
         std::map<std::string, std::string> formFields;
-        std::string body = requestBody;
+        std::string body(bodyData, bodyLength);
 
         size_t start = 0;
         size_t end = 0;
@@ -346,22 +1070,24 @@ Response Response::buildPostResponse(const requestParser &request, const std::st
             }
         }
 
-        std::string saveDir = docRoot;
-        std::string fileName = generateUniqueFilename("formData", ".txt");
-        std::string fullPath = saveDir + "/" + fileName;
-
-        std::ofstream file(fullPath.c_str());
-        if (!file.is_open())
+        std::string fileName;
+        int fd = createUploadFile(docRoot, "formData", ".txt", fileName);
+        if (fd == -1)
         {
-            send_error_response(client_fd, 500, "Internal Server Error", serverConfig);
-            return Response();
+            return buildErrorResponse(500, "Internal Server Error", serverConfig);
         }
 
+        std::string saved;
         for (std::map<std::string, std::string>::iterator iter = formFields.begin(); iter != formFields.end(); ++iter)
         {
-            file << iter->first << ": " << iter->second << "\n";
+            saved += iter->first + ": " + iter->second + "\n";
+        }
+        bool ok = writeAll(fd, saved.data(), saved.size());
+        if (close(fd) != 0 || !ok)
+        {
+            unlink((docRoot + "/" + fileName).c_str());
+            return buildErrorResponse(500, "Internal Server Error", serverConfig);
         }
-        file.close();
 
         Response response;
         response.setStatus(201, "Created");
@@ -384,20 +1110,12 @@ Response Response::buildPostResponse(const requestParser &request, const std::st
     }
     else if (contentType.find("application/json") != std::string::npos)
     {
-        std::string saveDir = docRoot;
-        std::string fileName = generateUniqueFilename("jsonData", ".json");
-        std::string fullPath = saveDir + "/" + fileName;
-
-        std::ofstream file(fullPath.c_str());
-        if (!file.is_open())
+        std::string fileName;
+        if (!saveRequestBody(request, docRoot, "jsonData", ".json", fileName))
         {
-            send_error_response(client_fd, 500, "Internal Server Error", serverConfig);
-            return Response();
+            return buildErrorResponse(500, "Internal Server Error", serverConfig);
         }
 
-        file << requestBody;
-        file.close();
-
         Response response;
         response.setStatus(201, "Created");
         response.addHeader("Content-Type", "application/json");
@@ -423,8 +1141,7 @@ Response Response::buildPostResponse(const requestParser &request, const std::st
 
         if (boundary.empty())
         {
-            send_error_response(client_fd, 400, "Bad Request", serverConfig);
-            return Response();
+            return buildErrorResponse(400, "Bad Request", serverConfig);
         }
 
         std::vector<std::string> uploadedFiles;
@@ -433,45 +1150,46 @@ Response Response::buildPostResponse(const requestParser &request, const std::st
         std::string closingBoundary = boundary + "--";
         size_t pos = 0;
 
-        while (pos < requestBody.length())
+        while (pos < bodyLength)
         {
-            size_t boundaryStart = requestBody.find(boundary, pos);
-            if (boundaryStart == std::string::npos)
+            const char *boundaryStart = static_cast<const char *>(memmem(bodyData + pos, bodyLength - pos, boundary.data(), boundary.size()));
+            if (!boundaryStart)
             {
                 break;
             }
 
-            pos = boundaryStart + boundary.length();
+            pos = (boundaryStart - bodyData) + boundary.length();
 
-            if (pos + 1 < requestBody.length() &&
-                requestBody[pos] == '\r' && requestBody[pos + 1] == '\n')
+            if (pos + 1 < bodyLength &&
+                bodyData[pos] == '\r' && bodyData[pos + 1] == '\n')
             {
                 pos += 2;
             }
 
-            size_t nextBoundaryStart = requestBody.find(boundary, pos);
-            if (nextBoundaryStart == std::string::npos)
+            const char *nextBoundary = static_cast<const char *>(memmem(bodyData + pos, bodyLength - pos, boundary.data(), boundary.size()));
+            if (!nextBoundary)
             {
                 break;
             }
+            size_t nextBoundaryStart = nextBoundary - bodyData;
 
-            std::string part = requestBody.substr(pos, nextBoundaryStart - pos);
-
-            if (part.length() >= 2 &&
-                part[part.length() - 2] == '\r' && part[part.length() - 1] == '\n')
+            size_t partEnd = nextBoundaryStart;
+            if (partEnd - pos >= 2 &&
+                bodyData[partEnd - 2] == '\r' && bodyData[partEnd - 1] == '\n')
             {
-                part = part.substr(0, part.length() - 2);
+                partEnd -= 2;
             }
 
-            size_t headerEnd = part.find("\r\n\r\n");
-            if (headerEnd == std::string::npos)
+            const char *headerEnd = static_cast<const char *>(memmem(bodyData + pos, partEnd - pos, "\r\n\r\n", 4));
+            if (!headerEnd)
             {
                 pos = nextBoundaryStart;
                 continue;
             }
 
-            std::string headers = part.substr(0, headerEnd);
-            std::string content = part.substr(headerEnd + 4);
+            std::string headers(bodyData + pos, headerEnd - (bodyData + pos));
+            const char *content = headerEnd + 4;
+            size_t contentLength = (bodyData + partEnd) - content;
 
             std::string name, filename;
 
@@ -508,14 +1226,14 @@ Response Response::buildPostResponse(const requestParser &request, const std::st
                 std::ofstream file(fullPath.c_str(), std::ios::binary);
                 if (file.is_open())
                 {
-                    file.write(content.c_str(), content.length());
+                    file.write(content, contentLength);
                     file.close();
                     uploadedFiles.push_back(filename);
                 }
             }
             else if (!name.empty())
             {
-                formFields[name] = content;
+                formFields[name] = std::string(content, contentLength);
             }
 
             pos = nextBoundaryStart;
@@ -587,18 +1305,11 @@ Response Response::buildPostResponse(const requestParser &request, const std::st
     }
     else
     {
-        std::string saveDir = docRoot;
-        std::string fileName = generateUniqueFilename("postData", ".txt");
-        std::string fullPath = saveDir + "/" + fileName;
-
-        std::ofstream file(fullPath.c_str());
-        if (!file.is_open())
+        std::string fileName;
+        if (!saveRequestBody(request, docRoot, "postData", ".txt", fileName))
         {
-            send_error_response(client_fd, 500, "Internal Server Error", serverConfig);
-            return Response();
+            return buildErrorResponse(500, "Internal Server Error", serverConfig);
         }
-        file << requestBody;
-        file.close();
 
         Response response;
         response.setStatus(201, "Created");
@@ -657,15 +1368,14 @@ bool deleteDirectory(const std::string &path)
     return rmdir(path.c_str()) == 0;
 }
 
-Response Response::buildDeleteResponse(const requestParser &request, const std::string &docRoot, int client_fd, const ConfigParser::ServerConfig &serverConfig)
+Response Response::buildDeleteResponse(const requestParser &request, const std::string &docRoot, const ConfigParser::ServerConfig &serverConfig)
 {
     std::string requestPath = request.getPath();
     std::string fullPath = docRoot;
 
     if (requestPath.empty() || requestPath == "/" || requestPath.find("..") != std::string::npos)
     {
-        send_error_response(client_fd, 403, "Forbidden", serverConfig);
-        return Response();
+        return buildErrorResponse(403, "Forbidden", serverConfig);
     }
 
     struct stat pathStat;
@@ -674,18 +1384,15 @@ Response Response::buildDeleteResponse(const requestParser &request, const std::
         perror("stat failed");
         if (errno == ENOENT)
         {
-            send_error_response(client_fd, 404, "Not Found", serverConfig);
-            return Response();
+            return buildErrorResponse(404, "Not Found", serverConfig);
         }
-        send_error_response(client_fd, 500, "Internal Server Error", serverConfig);
-        return Response();
+        return buildErrorResponse(500, "Internal Server Error", serverConfig);
     }
 
     if (access(fullPath.c_str(), W_OK) != 0)
     {
         perror("access failed");
-        send_error_response(client_fd, 403, "Forbidden", serverConfig);
-        return Response();
+        return buildErrorResponse(403, "Forbidden", serverConfig);
     }
 
     if (S_ISDIR(pathStat.st_mode))
@@ -693,8 +1400,7 @@ Response Response::buildDeleteResponse(const requestParser &request, const std::
         if (!deleteDirectory(fullPath))
         {
             std::cerr << "Failed to delete directory: " << fullPath << std::endl;
-            send_error_response(client_fd, 500, "Internal Server Error", serverConfig);
-            return Response();
+            return buildErrorResponse(500, "Internal Server Error", serverConfig);
         }
     }
     else
@@ -702,8 +1408,7 @@ Response Response::buildDeleteResponse(const requestParser &request, const std::
         if (remove(fullPath.c_str()) != 0)
         {
             perror("remove failed");
-            send_error_response(client_fd, 500, "Internal Server Error", serverConfig);
-            return Response();
+            return buildErrorResponse(500, "Internal Server Error", serverConfig);
         }
     }
 
@@ -4,44 +4,95 @@
 #include "../CGI/CGI.hpp"
 #include "../Server/Server.hpp"
 #include "../Parser/ConfigParser.hpp"
+#include "Gzip.hpp"
 
 #include <sstream>
 #include <algorithm>
 
 class Response
 {
+public:
+    // A slice of the file body, preceded by bytes sent from memory (the part
+    // headers of a multipart/byteranges response).
+    struct FileRange
+    {
+        std::string prefix;
+        off_t offset;
+        size_t length;
+    };
+
 private:
     int statusCode;
     std::string statusMessage;
     std::map<std::string, std::string> _headers;
     std::string _body;
     std::string _httpVersion;
+    OpenFile *_file;
+    std::vector<FileRange> _fileRanges;
+    std::string _fileTrailer;
+    bool _gzipStream;
+    StaticCache::Item *_cached;
+    const ConfigParser::Prerendered *_prerendered;
+
+    static Response renderErrorResponse(int status_code, const std::string &message, const ConfigParser::ServerConfig &serverConfig);
+    static void prerender(const Response &response, ConfigParser::Prerendered &out);
+    static bool buildGzipBody(Response &response, const requestParser &request, const std::string &filePath, const OpenFileCache::Entry &file, StaticCache &gzipCache);
+    static bool buildPrecompressedResponse(Response &response, const requestParser &request, const std::string &filePath, const OpenFileCache::Entry &file, const ConfigParser::ServerConfig &serverConfig, OpenFileCache &fileCache);
 
 public:
     Response();
     ~Response();
 
-    ConfigParser::ServerConfig serverConfig;
     void setStatus(int code, const std::string &message);
     void addHeader(const std::string &key, const std::string &value);
     void setBody(const std::string &body);
     void setHttpVersion(const std::string &version);
+    void setFileBody(OpenFile *file, off_t offset, size_t length);
+    void addFileRange(const std::string &prefix, off_t offset, size_t length);
+    void setFileTrailer(const std::string &trailer);
+    void setCachedBody(StaticCache::Item *item);
+    void setGzipBody(OpenFile *file, size_t length);
+    void applyGzip(const requestParser &request, const ConfigParser::ServerConfig &serverConfig);
 
     int getStatusCode() const;
     const std::string &getStatusText() const;
     const std::map<std::string, std::string> &getHeaders() const;
     const std::string &getBody() const;
     const std::string &getHttpVersion() const;
+    bool hasFileBody() const;
+    OpenFile *getFile() const;
+    const std::vector<FileRange> &getFileRanges() const;
+    const std::string &getFileTrailer() const;
+    StaticCache::Item *getCachedBody() const;
+    bool isGzipStream() const;
+    bool isPrerendered() const;
+    const std::string &getPrerendered(bool keep_alive) const;
 
+    void serializeHead(std::string &out) const;
+    static void appendChunk(std::string &out, const char *data, size_t length);
     std::string toString() const;
-    static Response buildFileResponse(const std::string &filePath, const ConfigParser::ServerConfig &serverConfig, int client_fd);
+    std::string &releaseBody();
+    static Response buildFileResponse(const requestParser &request, const std::string &filePath, const OpenFileCache::Entry &file, const ConfigParser::ServerConfig &serverConfig, StaticCache &staticCache, StaticCache &gzipCache);
+    static Response buildErrorResponse(int status_code, const std::string &message, const ConfigParser::ServerConfig &serverConfig);
+    static Response buildRedirectResponse(int status_code, const std::string &location_url, const std::string &status_text);
+    static Response buildPrerendered(int status_code, const std::string &status_text, const ConfigParser::Prerendered &prerendered);
+    static void prerenderServer(ConfigParser::ServerConfig &serverConfig);
 
     static std::string getFileExtension(const std::string &filePath);
     static bool fileExists(const std::string &filePath);
     static std::string getContentType(const std::string &filePath);
+    static std::string httpDate(time_t when);
+    static std::string entityTag(const OpenFileCache::Entry &file);
+    static std::string entityHeaders(const std::string &filePath, const OpenFileCache::Entry &file);
+    static bool gzipEligible(const ConfigParser::ServerConfig &serverConfig, const std::string &contentType, size_t length);
+    static bool isNotModified(const requestParser &request, const OpenFileCache::Entry &file);
+    static Response buildNotModifiedResponse(const OpenFileCache::Entry &file);
+    static bool ifRangeMatches(const requestParser &request, const OpenFileCache::Entry &file);
+    static bool parseRanges(const std::string &header, off_t size, std::vector<std::pair<off_t, off_t> > &ranges);
+    static Response buildRangeResponse(const std::string &filePath, const OpenFileCache::Entry &file, const std::vector<std::pair<off_t, off_t> > &ranges, const ConfigParser::ServerConfig &serverConfig);
     static Response buildAutoindexResponse(const std::string &htmlContent);
 
-    static Response buildGetResponse(const requestParser &request, const std::string &docRoot, const bool autoIndex, int client_fd, const ConfigParser::ServerConfig &serverConfig);
-    static Response buildPostResponse(const requestParser &request, const std::string &docRoot, int client_fd, const ConfigParser::ServerConfig &serverConfig);
-    static Response buildDeleteResponse(const requestParser &request, const std::string &docRoot, int client_fd, const ConfigParser::ServerConfig &serverConfig);
+    static Response buildGetResponse(const requestParser &request, const std::string &docRoot, const OpenFileCache::Entry &entry, const bool autoIndex, const ConfigParser::ServerConfig &serverConfig, OpenFileCache &fileCache, StaticCache &staticCache, StaticCache &gzipCache);
+    static Response buildPostResponse(const requestParser &request, const std::string &docRoot, const ConfigParser::ServerConfig &serverConfig);
+    static Response buildDeleteResponse(const requestParser &request, const std::string &docRoot, const ConfigParser::ServerConfig &serverConfig);
 };
@@ -0,0 +1,144 @@
+#include "Master.hpp"
+#include "Server.hpp"
+
+volatile sig_atomic_t Master::_stop_signal = 0;
+
+Master::Master(const ConfigParser &parser) : _parser(parser), _worker_count(parser.getWorkerProcesses())
+{
+}
+
+Master::~Master()
+{
+}
+
+void Master::signalHandler(int signum)
+{
+    _stop_signal = signum;
+}
+
+int Master::runWorker(const ConfigParser &parser, bool reuse_port)
+{
+    Server server;
+    server.setupServers(parser, reuse_port);
+    server.handleConnections();
+    server.Cleanup();
+    return 0;
+}
+
+pid_t Master::spawnWorker(int slot)
+{
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        // Do not outlive the master if it is killed without a chance to forward the signal
+        prctl(PR_SET_PDEATHSIG, SIGQUIT);
+        if (getppid() == 1)
+            exit(EXIT_SUCCESS);
+        exit(runWorker(_parser, true));
+    }
+
+    _workers[pid] = slot;
+    Utils::log("Started worker " + Utils::intToString(slot) + " (pid " + Utils::intToString(pid) + ")", AnsiColor::BOLD_GREEN);
+    return pid;
+}
+
+// Records a crash of the slot's worker. A worker that dies right after
+// starting, every time, would otherwise be forked again in a tight loop.
+bool Master::mayRespawn(int slot)
+{
+    time_t now = time(NULL);
+    std::deque<time_t> &crashes = _crashes[slot];
+    crashes.push_back(now);
+    while (crashes.front() + RESPAWN_WINDOW <= now)
+        crashes.pop_front();
+    return crashes.size() < MAX_RESPAWNS;
+}
+
+void Master::stopWorkers(int signum)
+{
+    for (std::map<pid_t, int>::iterator it = _workers.begin(); it != _workers.end(); ++it)
+        kill(it->first, signum);
+
+    while (!_workers.empty())
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        _workers.erase(pid);
+    }
+}
+
+int Master::run()
+{
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signalHandler;
+    sigemptyset(&sa.sa_mask);
+    // No SA_RESTART: waitpid() must return EINTR so the loop sees the stop request
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGQUIT, &sa, NULL);
+
+    Utils::log("Master process " + Utils::intToString(getpid()) + " starting " + Utils::intToString(_worker_count) + " workers", AnsiColor::BOLD_CYAN);
+    for (int i = 0; i < _worker_count; ++i)
+        spawnWorker(i);
+
+    while (!_stop_signal && !_workers.empty())
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("waitpid");
+            break;
+        }
+
+        std::map<pid_t, int>::iterator it = _workers.find(pid);
+        if (it == _workers.end())
+            continue;
+        int slot = it->second;
+        _workers.erase(it);
+
+        // A worker that exits on its own failed to set up (e.g. bind error);
+        // respawning it would only fail again.
+        if (WIFEXITED(status))
+        {
+            Utils::log("Worker " + Utils::intToString(slot) + " exited with status " + Utils::intToString(WEXITSTATUS(status)), AnsiColor::BOLD_RED);
+            continue;
+        }
+
+        if (_stop_signal)
+            continue;
+        if (!mayRespawn(slot))
+        {
+            Utils::log("Worker " + Utils::intToString(slot) + " killed by signal " + Utils::intToString(WTERMSIG(status)) + ", crashed " +
+                           Utils::intToString(MAX_RESPAWNS) + " times within " + Utils::intToString(RESPAWN_WINDOW) + "s, not respawning",
+                       AnsiColor::BOLD_RED);
+            continue;
+        }
+        Utils::log("Worker " + Utils::intToString(slot) + " killed by signal " + Utils::intToString(WTERMSIG(status)) + ", respawning", AnsiColor::BOLD_RED);
+        spawnWorker(slot);
+    }
+
+    if (!_stop_signal)
+    {
+        stopWorkers(SIGQUIT);
+        return 1;
+    }
+    stopWorkers(_stop_signal);
+    return 0;
+}
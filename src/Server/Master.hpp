@@ -0,0 +1,42 @@
+#pragma once
+
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <map>
+#include <deque>
+#include <ctime>
+#include "../Parser/ConfigParser.hpp"
+
+// Pre-fork process supervisor. The master parses the configuration once,
+// forks worker_processes children that each run their own Server (own
+// SO_REUSEPORT listeners and epoll loop), respawns workers that crash and
+// forwards SIGINT/SIGQUIT to them on shutdown. A worker that keeps crashing
+// (MAX_RESPAWNS times within RESPAWN_WINDOW seconds) is not respawned again.
+class Master
+{
+private:
+    static const size_t MAX_RESPAWNS = 5;
+    static const time_t RESPAWN_WINDOW = 10;
+
+    const ConfigParser &_parser;
+    int _worker_count;
+    std::map<pid_t, int> _workers;
+    // Recent crash times of each worker slot.
+    std::map<int, std::deque<time_t> > _crashes;
+
+    static volatile sig_atomic_t _stop_signal;
+    static void signalHandler(int signum);
+
+    pid_t spawnWorker(int slot);
+    bool mayRespawn(int slot);
+    void stopWorkers(int signum);
+
+public:
+    Master(const ConfigParser &parser);
+    ~Master();
+
+    int run();
+    static int runWorker(const ConfigParser &parser, bool reuse_port);
+};
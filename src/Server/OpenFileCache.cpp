@@ -0,0 +1,296 @@
+#include "OpenFileCache.hpp"
+#include "TimerWheel.hpp"
+#include "../Utils/AnsiColor.hpp"
+#include "../Utils/Logger.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+static const uint32_t WATCH_MASK = IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+OpenFile::OpenFile(int fd) : _fd(fd), _refs(1) {}
+
+OpenFile::~OpenFile()
+{
+    close(_fd);
+}
+
+// Takes ownership of fd; the caller holds the first reference.
+OpenFile *OpenFile::adopt(int fd)
+{
+    return new OpenFile(fd);
+}
+
+int OpenFile::getFd() const
+{
+    return _fd;
+}
+
+void OpenFile::retain()
+{
+    ++_refs;
+}
+
+void OpenFile::release()
+{
+    if (--_refs == 0)
+        delete this;
+}
+
+OpenFileCache::Entry::Entry() : error(0), is_dir(false), file(NULL), size(0), mtime(0), dev(0), inode(0),
+                                validated(0), watched(false) {}
+
+OpenFileCache::OpenFileCache() : _max_entries(0), _valid_ms(60 * 1000L), _inotify_fd(-1) {}
+
+OpenFileCache::~OpenFileCache()
+{
+    clear();
+    if (_inotify_fd != -1)
+        close(_inotify_fd);
+}
+
+void OpenFileCache::configure(size_t max_entries, int valid_seconds)
+{
+    clear();
+    _max_entries = max_entries;
+    _valid_ms = valid_seconds * 1000L;
+
+    if (_max_entries > 0 && _inotify_fd == -1)
+    {
+        _inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (_inotify_fd == -1)
+            Utils::log("inotify unavailable, open_file_cache relies on open_file_cache_valid", AnsiColor::BOLD_YELLOW);
+    }
+}
+
+int OpenFileCache::getInotifyFd() const
+{
+    return _inotify_fd;
+}
+
+// The returned entry stays valid until the next call into the cache.
+const OpenFileCache::Entry &OpenFileCache::lookup(const std::string &path)
+{
+    if (_max_entries == 0)
+    {
+        if (_uncached.file)
+            _uncached.file->release();
+        _uncached = Entry();
+        _uncached.path = path;
+        load(_uncached);
+        return _uncached;
+    }
+
+    long now = TimerWheel::now();
+    std::map<std::string, EntryList::iterator>::iterator found = _index.find(path);
+    if (found != _index.end())
+    {
+        EntryList::iterator entry = found->second;
+        if (now - entry->validated < _valid_ms || isUnchanged(*entry))
+        {
+            if (now - entry->validated >= _valid_ms)
+                entry->validated = now;
+            _lru.splice(_lru.begin(), _lru, entry);
+            return *entry;
+        }
+        erase(entry);
+    }
+
+    if (_lru.size() >= _max_entries)
+        erase(--_lru.end());
+
+    _lru.push_front(Entry());
+    Entry &entry = _lru.front();
+    entry.path = path;
+    entry.validated = now;
+    load(entry);
+    _index[path] = _lru.begin();
+
+    std::string dir = parentOf(path);
+    watch(dir);
+    entry.watched = _watched_dirs.count(dir) != 0;
+    return entry;
+}
+
+void OpenFileCache::load(Entry &entry)
+{
+    struct stat st;
+    int fd = open(entry.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        entry.error = errno;
+        // A directory we may not list can still hold a readable index file.
+        if (entry.error == EACCES && stat(entry.path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            entry.error = 0;
+            entry.is_dir = true;
+            entry.dev = st.st_dev;
+            entry.inode = st.st_ino;
+            entry.mtime = st.st_mtime;
+        }
+        return;
+    }
+
+    if (fstat(fd, &st) == -1)
+    {
+        entry.error = errno;
+        close(fd);
+        return;
+    }
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+    entry.dev = st.st_dev;
+    entry.inode = st.st_ino;
+
+    if (S_ISDIR(st.st_mode))
+    {
+        entry.is_dir = true;
+        close(fd);
+    }
+    else if (!S_ISREG(st.st_mode))
+    {
+        entry.error = EINVAL;
+        close(fd);
+    }
+    else
+        entry.file = OpenFile::adopt(fd);
+}
+
+bool OpenFileCache::isUnchanged(const Entry &entry)
+{
+    struct stat st;
+    if (stat(entry.path.c_str(), &st) == -1)
+        return entry.error == errno;
+    if (entry.error != 0)
+        return false;
+    return st.st_dev == entry.dev && st.st_ino == entry.inode && st.st_mtime == entry.mtime &&
+           S_ISDIR(st.st_mode) == entry.is_dir && (entry.is_dir || st.st_size == entry.size);
+}
+
+std::string OpenFileCache::parentOf(const std::string &path)
+{
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos)
+        return ".";
+    if (slash == 0)
+        return "/";
+    return path.substr(0, slash);
+}
+
+void OpenFileCache::invalidate(const std::string &path)
+{
+    std::map<std::string, EntryList::iterator>::iterator found = _index.find(path);
+    if (found != _index.end())
+        erase(found->second);
+}
+
+void OpenFileCache::erase(EntryList::iterator entry)
+{
+    if (entry->file)
+        entry->file->release();
+    if (entry->watched)
+        unwatch(parentOf(entry->path));
+    _index.erase(entry->path);
+    _lru.erase(entry);
+}
+
+void OpenFileCache::invalidateDirectory(const std::string &dir)
+{
+    EntryList::iterator it = _lru.begin();
+    while (it != _lru.end())
+    {
+        EntryList::iterator current = it++;
+        if (parentOf(current->path) == dir)
+            erase(current);
+    }
+}
+
+void OpenFileCache::clear()
+{
+    while (!_lru.empty())
+        erase(_lru.begin());
+    if (_uncached.file)
+        _uncached.file->release();
+    _uncached = Entry();
+}
+
+// One watch per directory holding cached entries, removed with the last one.
+void OpenFileCache::watch(const std::string &dir)
+{
+    if (_inotify_fd == -1)
+        return;
+
+    std::map<std::string, int>::iterator found = _watched_dirs.find(dir);
+    if (found != _watched_dirs.end())
+    {
+        ++_watches[found->second].entries;
+        return;
+    }
+
+    int wd = inotify_add_watch(_inotify_fd, dir.c_str(), WATCH_MASK);
+    // Another name for a directory that is already watched (a symlink) is
+    // left to the validity check.
+    if (wd == -1 || _watches.count(wd))
+        return;
+
+    Watch &watch = _watches[wd];
+    watch.dir = dir;
+    watch.entries = 1;
+    _watched_dirs[dir] = wd;
+}
+
+void OpenFileCache::unwatch(const std::string &dir)
+{
+    std::map<std::string, int>::iterator found = _watched_dirs.find(dir);
+    if (found == _watched_dirs.end())
+        return;
+
+    int wd = found->second;
+    if (--_watches[wd].entries > 0)
+        return;
+    inotify_rm_watch(_inotify_fd, wd);
+    _watches.erase(wd);
+    _watched_dirs.erase(found);
+}
+
+// Drains the inotify queue. Changes made by this process are queued before
+// the syscall making them returns, so calling this right after a write
+// leaves no stale entry behind.
+void OpenFileCache::processEvents()
+{
+    if (_inotify_fd == -1)
+        return;
+
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(_inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *ptr = buffer; ptr < buffer + len;)
+        {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                clear();
+                continue;
+            }
+
+            std::map<int, Watch>::iterator watch = _watches.find(event->wd);
+            if (watch == _watches.end())
+                continue;
+            std::string dir = watch->second.dir;
+
+            if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+                invalidateDirectory(dir);
+            else if (event->len > 0 && dir == ".")
+                invalidate(event->name);
+            else if (event->len > 0)
+                invalidate((dir == "/" ? dir : dir + "/") + event->name);
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <map>
+#include <ctime>
+#include <sys/types.h>
+
+// A file descriptor shared by the open file cache and every response still
+// streaming from it. sendfile() is always given an explicit offset, so one
+// descriptor can serve any number of connections; it is closed once the last
+// reference is released.
+class OpenFile
+{
+public:
+    static OpenFile *adopt(int fd);
+
+    int getFd() const;
+    void retain();
+    void release();
+
+private:
+    int _fd;
+    int _refs;
+
+    explicit OpenFile(int fd);
+    ~OpenFile();
+    OpenFile(const OpenFile &);
+    OpenFile &operator=(const OpenFile &);
+};
+
+// LRU of what a static GET needs to know about a path: whether it exists,
+// is readable, is a directory, or else an open descriptor with its size and
+// mtime. Entries are dropped as soon as inotify reports a change in their
+// directory, and are re-checked with stat() once open_file_cache_valid has
+// passed in case no watch could be set. With the cache off every lookup goes
+// to the filesystem, which still costs only open() and fstat().
+class OpenFileCache
+{
+public:
+    struct Entry
+    {
+        std::string path;
+        int error;
+        bool is_dir;
+        OpenFile *file;
+        off_t size;
+        time_t mtime;
+        dev_t dev;
+        ino_t inode;
+        long validated;
+        bool watched;
+
+        Entry();
+    };
+
+    OpenFileCache();
+    ~OpenFileCache();
+
+    void configure(size_t max_entries, int valid_seconds);
+    const Entry &lookup(const std::string &path);
+    void invalidate(const std::string &path);
+    void processEvents();
+    void clear();
+    int getInotifyFd() const;
+
+private:
+    struct Watch
+    {
+        std::string dir;
+        size_t entries;
+    };
+
+    typedef std::list<Entry> EntryList;
+
+    EntryList _lru;
+    std::map<std::string, EntryList::iterator> _index;
+    size_t _max_entries;
+    long _valid_ms;
+    int _inotify_fd;
+    std::map<int, Watch> _watches;
+    std::map<std::string, int> _watched_dirs;
+    Entry _uncached;
+
+    OpenFileCache(const OpenFileCache &);
+    OpenFileCache &operator=(const OpenFileCache &);
+
+    static void load(Entry &entry);
+    static bool isUnchanged(const Entry &entry);
+    static std::string parentOf(const std::string &path);
+    void erase(EntryList::iterator entry);
+    void invalidateDirectory(const std::string &dir);
+    void watch(const std::string &dir);
+    void unwatch(const std::string &dir);
+};
@@ -1,27 +1,129 @@
 #include "Server.hpp"
 
-Server::Server()
+Server::Slot::Slot() : fd(-1), type(SLOT_FREE), client(NULL), hosts(NULL), server(NULL), owner(-1), fastcgi(NULL) {}
+
+void Server::Slot::clear()
 {
-    epoll_fd = epoll_create1(0);
+    type = SLOT_FREE;
+    client = NULL;
+    hosts = NULL;
+    server = NULL;
+    owner = -1;
+    fastcgi = NULL;
+}
+
+Server::Listener::Listener(int socket, const std::string &addr) : fd(socket), address(addr), accepted(0), queue_limit(0),
+                                                               peak_queue(0), full_wakeups(0), capped_wakeups(0),
+                                                               nopush(false) {}
+
+Server::Server() : config(NULL)
+{
+    // Descriptors index the slot table directly. Lowering the soft limit to
+    // its size keeps every fd the kernel hands out in range; accept() fails
+    // with EMFILE beyond it.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    {
+        perror("getrlimit");
+        exit(EXIT_FAILURE);
+    }
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > MAX_SLOTS)
+    {
+        limit.rlim_cur = MAX_SLOTS;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+        {
+            perror("setrlimit");
+            exit(EXIT_FAILURE);
+        }
+    }
+    slots.resize(limit.rlim_cur);
+    for (size_t i = 0; i < slots.size(); ++i)
+        slots[i].fd = i;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
     if (epoll_fd == -1)
     {
         perror("epoll_create1");
         exit(EXIT_FAILURE);
     }
+
+    // The SIGCHLD handler only writes a byte into this pipe; the event loop
+    // reads it and reaps the finished CGI scripts.
+    if (pipe2(sigchld_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        perror("pipe2");
+        exit(EXIT_FAILURE);
+    }
+    _sigchld_fd = sigchld_pipe[1];
+
+    if (!watchFd(sigchld_pipe[0], EPOLLIN, SLOT_SIGCHLD))
+    {
+        perror("epoll_ctl: sigchld_pipe");
+        exit(EXIT_FAILURE);
+    }
 }
 
 Server::~Server()
 {
-    close(epoll_fd);
-    for (std::map<int, Client *>::iterator iter = clients.begin(); iter != clients.end(); ++iter)
+    if (epoll_fd != -1)
+        close(epoll_fd);
+    for (size_t i = 0; i < slots.size(); ++i)
     {
-        delete iter->second;
+        if (slots[i].type == SLOT_CLIENT)
+            delete slots[i].client;
     }
+    for (size_t i = 0; i < spareClients.size(); ++i)
+        delete spareClients[i];
+}
+
+// Registers fd with epoll, pointing its event data at the fd's slot.
+bool Server::watchFd(int fd, uint32_t events, SlotType type)
+{
+    Slot &slot = slots[fd];
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = &slot;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        return false;
+    slot.type = type;
+    return true;
 }
 
-int create_server_socket(const std::string &host, int port)
+static bool set_tcp_option(int fd, int level, int name, int value, const char *label)
 {
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == -1)
+    {
+        perror(label);
+        return false;
+    }
+    return true;
+}
+
+// Applies the tuning parameters of a listen directive. Accepted connections
+// inherit the buffer sizes and TCP_NODELAY from the listening socket.
+static bool configure_listen_socket(int fd, const ConfigParser::Listen &listen)
+{
+    if (listen.rcvbuf > 0 && !set_tcp_option(fd, SOL_SOCKET, SO_RCVBUF, listen.rcvbuf, "setsockopt SO_RCVBUF"))
+        return false;
+    if (listen.sndbuf > 0 && !set_tcp_option(fd, SOL_SOCKET, SO_SNDBUF, listen.sndbuf, "setsockopt SO_SNDBUF"))
+        return false;
+    if (listen.nodelay && !set_tcp_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "setsockopt TCP_NODELAY"))
+        return false;
+    // How long a connection waited for its first data cannot be told, so
+    // wait a second, as nginx does; the header timeout covers the rest.
+    if (listen.deferred && !set_tcp_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, 1, "setsockopt TCP_DEFER_ACCEPT"))
+        return false;
+    if (listen.fastopen > 0 && !set_tcp_option(fd, IPPROTO_TCP, TCP_FASTOPEN, listen.fastopen, "setsockopt TCP_FASTOPEN"))
+        return false;
+    return true;
+}
+
+int create_server_socket(const ConfigParser::Listen &listen, bool reuse_port)
+{
+    const std::string &host = listen.host;
+    int port = std::atoi(listen.port.c_str());
+
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_fd == -1)
     {
         perror("socket");
@@ -36,6 +138,15 @@ int create_server_socket(const std::string &host, int port)
         return -1;
     }
 
+    // Every worker process binds its own listener to the same address and
+    // the kernel spreads incoming connections across them.
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
+    {
+        perror("setsockopt SO_REUSEPORT");
+        close(server_fd);
+        return -1;
+    }
+
     struct sockaddr_in addr;
     std::memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -71,7 +182,14 @@ int create_server_socket(const std::string &host, int port)
         return -1;
     }
 
-    if (listen(server_fd, 10) == -1)
+    if (!configure_listen_socket(server_fd, listen))
+    {
+        close(server_fd);
+        return -1;
+    }
+
+    int backlog = listen.backlog > 0 ? listen.backlog : ConfigParser::Listen::DEFAULT_BACKLOG;
+    if (::listen(server_fd, backlog) == -1)
     {
         perror("listen");
         close(server_fd);
@@ -81,9 +199,38 @@ int create_server_socket(const std::string &host, int port)
     return server_fd;
 }
 
-void Server::setupServers(const ConfigParser &parser)
+void Server::setupServers(const ConfigParser &parser, bool reuse_port)
 {
-    const std::vector<ConfigParser::ServerConfig> &serverConfigs = parser.getServers();
+    std::vector<ConfigParser::ServerConfig> servers = parser.getServers();
+    for (size_t i = 0; i < servers.size(); ++i)
+        Response::prerenderServer(servers[i]);
+    config = ConfigSnapshot::create(servers);
+
+    fileCache.configure(parser.getOpenFileCacheMax(), parser.getOpenFileCacheValid());
+    staticCache.configure(parser.getStaticCacheSize());
+    gzipCache.configure(parser.getGzipCacheSize());
+    if (fileCache.getInotifyFd() != -1)
+    {
+        if (!watchFd(fileCache.getInotifyFd(), EPOLLIN, SLOT_INOTIFY))
+        {
+            perror("epoll_ctl: inotify");
+            exit(EXIT_FAILURE);
+        }
+    }
+    const std::vector<ConfigParser::ServerConfig> &serverConfigs = config->getServers();
+    std::map<std::string, int> sockets;
+
+    // Socket options come from whichever listen of a host:port sets them.
+    std::map<std::string, const ConfigParser::Listen *> options;
+    for (size_t i = 0; i < serverConfigs.size(); ++i)
+    {
+        for (size_t j = 0; j < serverConfigs[i].listen.size(); ++j)
+        {
+            const ConfigParser::Listen &listen = serverConfigs[i].listen[j];
+            if (listen.setsSocketOptions())
+                options[listen.host + ":" + listen.port] = &listen;
+        }
+    }
 
     for (size_t i = 0; i < serverConfigs.size(); ++i)
     {
@@ -96,9 +243,19 @@ void Server::setupServers(const ConfigParser &parser)
             std::string port = listen.port;
             std::string hostPortKey = host + ":" + port;
 
+            // Server blocks sharing a host:port share one socket; the Host
+            // header picks between them.
+            std::map<std::string, int>::iterator existing = sockets.find(hostPortKey);
+            if (existing != sockets.end())
+            {
+                virtualHosts[existing->second].addServer(server, listen.default_server);
+                continue;
+            }
+
             Utils::log("Setting up server on " + host + ":" + port, AnsiColor::BOLD_YELLOW);
 
-            int server_fd = create_server_socket(host, std::atoi(port.c_str()));
+            const ConfigParser::Listen &socketOptions = options.count(hostPortKey) ? *options[hostPortKey] : listen;
+            int server_fd = create_server_socket(socketOptions, reuse_port);
             if (server_fd == -1)
             {
                 Utils::log("Failed to create server socket on " + host + ":" + port, AnsiColor::BOLD_RED);
@@ -106,37 +263,24 @@ void Server::setupServers(const ConfigParser &parser)
                 exit(EXIT_FAILURE);
             }
 
-            std::vector<ConfigParser::ServerConfig> matchedConfigs;
-            for (size_t k = 0; k < serverConfigs.size(); ++k)
-            {
-                const ConfigParser::ServerConfig &other = serverConfigs[k];
-                for (size_t l = 0; l < other.listen.size(); ++l)
-                {
-                    if (other.listen[l].host == host && other.listen[l].port == port)
-                    {
-                        matchedConfigs.push_back(other);
-                        break;
-                    }
-                }
-            }
+            sockets[hostPortKey] = server_fd;
+            virtualHosts[server_fd].addServer(server, listen.default_server);
 
-            serverConfigMap[server_fd] = matchedConfigs;
-
-            struct epoll_event ev;
-            ev.events = EPOLLIN;
-            ev.data.fd = server_fd;
-
-            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1)
+            if (!watchFd(server_fd, EPOLLIN, SLOT_LISTENER))
             {
                 perror("epoll_ctl: server_fd");
                 exit(EXIT_FAILURE);
             }
-            server_fds.insert(server_fd);
+            slots[server_fd].hosts = &virtualHosts[server_fd];
+            slots[server_fd].owner = listeners.size();
+            listeners.push_back(Listener(server_fd, hostPortKey));
+            listeners.back().nopush = socketOptions.nopush;
         }
     }
 }
 
 volatile sig_atomic_t Server::_turnoff = 0;
+int Server::_sigchld_fd = -1;
 
 void sighandler(int signum)
 {
@@ -146,41 +290,91 @@ void sighandler(int signum)
     }
 }
 
+void sigchld_handler(int)
+{
+    int saved_errno = errno;
+    if (Server::_sigchld_fd != -1 && write(Server::_sigchld_fd, "x", 1) == -1)
+    {
+        // The pipe is full, so a wakeup is already pending.
+    }
+    errno = saved_errno;
+}
+
+// Drains the accept queue, up to MAX_ACCEPTS connections. Listeners are
+// level-triggered, so whatever is left wakes us up again after the other
+// ready descriptors have been served.
 void Server::acceptNewConnection(int server_fd)
 {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    Listener &listener = listeners[slots[server_fd].owner];
+    sampleAcceptQueue(listener);
 
-    int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-    if (client_fd == -1)
+    for (int accepted = 0; accepted < MAX_ACCEPTS;)
     {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept4(server_fd, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept4");
             return;
-        perror("accept");
-        return;
+        }
+        ++accepted;
+        ++listener.accepted;
+        openClientConnection(client_fd, server_fd, client_addr);
     }
 
-    int flags = fcntl(client_fd, F_GETFL, 0);
-    if (flags == -1 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1)
-    {
-        perror("fcntl");
-        close(client_fd);
+    // The last accept may have emptied the queue; only count a wakeup the
+    // cap actually cut short.
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(server_fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && info.tcpi_unacked > 0)
+        ++listener.capped_wakeups;
+}
+
+// The kernel reports the accept queue of a listening socket in TCP_INFO:
+// tcpi_unacked holds its length and tcpi_sacked its limit.
+void Server::sampleAcceptQueue(Listener &listener)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(listener.fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1)
         return;
-    }
 
-    struct epoll_event event;
-    event.events = EPOLLIN | EPOLLET;
-    event.data.fd = client_fd;
+    listener.queue_limit = info.tcpi_sacked;
+    if (info.tcpi_unacked > listener.peak_queue)
+        listener.peak_queue = info.tcpi_unacked;
+    if (info.tcpi_unacked >= info.tcpi_sacked)
+        ++listener.full_wakeups;
+}
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1)
+void Server::openClientConnection(int client_fd, int server_fd, const struct sockaddr_in &client_addr)
+{
+    if (!watchFd(client_fd, EPOLLIN | EPOLLET, SLOT_CLIENT))
     {
         perror("epoll_ctl: client_fd");
         close(client_fd);
         return;
     }
 
-    clients[client_fd] = new Client(client_fd);
-    clientToServergMap[client_fd] = serverConfigMap[server_fd][0];
+    // Clients of closed connections are recycled with their buffers.
+    Slot &slot = slots[client_fd];
+    if (spareClients.empty())
+        slot.client = new Client(client_fd);
+    else
+    {
+        slot.client = spareClients.back();
+        spareClients.pop_back();
+        slot.client->reset(client_fd);
+    }
+    slot.client->setNoPush(listeners[slots[server_fd].owner].nopush);
+    slot.hosts = slots[server_fd].hosts;
+    slot.server = &slot.hosts->getDefault();
+    config->retain();
+    armTimer(client_fd, HEADER_TIMEOUT);
 
     Utils::log("New connection from " + std::string(inet_ntoa(client_addr.sin_addr)) + ":" + to_string_c98(ntohs(client_addr.sin_port)) + " (fd: " + to_string_c98(client_fd) + ")", AnsiColor::BOLD_GREEN);
 }
@@ -193,12 +387,13 @@ void Server::closeClientConnection(int client_fd)
         return;
     }
 
-    std::map<int, Client *>::iterator it = clients.find(client_fd);
-    if (it != clients.end())
-    {
-        delete it->second;
-        clients.erase(it);
-    }
+    Slot &slot = slots[client_fd];
+    abortCGI(client_fd);
+    timers.cancel(slot.client->getTimer());
+    slot.client->reset(-1);
+    spareClients.push_back(slot.client);
+    slot.clear();
+    config->release();
 
     if (close(client_fd) == -1)
         perror("close");
@@ -273,22 +468,12 @@ void normalize_path(std::string &path)
         path.erase(path.length() - 1);
 }
 
-const ConfigParser::LocationConfig *findMatchingLocation(const std::vector<ConfigParser::LocationConfig> &locations, const std::string &requestPath)
+const ConfigParser::LocationConfig *findMatchingLocation(const ConfigParser::ServerConfig &serverConfig, const std::string &requestPath)
 {
-    size_t longestMatch = 0;
-    const ConfigParser::LocationConfig *bestMatch = NULL;
-
-    for (size_t i = 0; i < locations.size(); ++i)
-    {
-        const std::string &locPath = locations[i].path;
-        if (requestPath.find(locPath) == 0 && locPath.length() > longestMatch)
-        {
-            longestMatch = locPath.length();
-            bestMatch = &locations[i];
-        }
-    }
-
-    return bestMatch;
+    size_t index = serverConfig.location_trie.find(requestPath);
+    if (index == LocationTrie::npos)
+        return NULL;
+    return &serverConfig.locations[index];
 }
 
 bool isDirectory(const std::string &path)
@@ -365,66 +550,124 @@ void printRequest(const requestParser &req)
     std::cout << "-----------------------------" << std::endl;
 }
 
+void Server::queueResponse(Client *client, Response &response)
+{
+    if (response.isPrerendered())
+    {
+        client->queueStatic(&response.getPrerendered(client->isKeepAlive()));
+        return;
+    }
+    response.applyGzip(client->getRequest(), *slots[client->getFd()].server);
+    response.addHeader("Connection", client->isKeepAlive() ? "keep-alive" : "close");
+    response.serializeHead(client->queueBuffer());
+    client->queueBody(response.releaseBody());
+    if (response.getCachedBody())
+        client->queueCached(response.getCachedBody());
+    if (response.isGzipStream())
+    {
+        const Response::FileRange &range = response.getFileRanges()[0];
+        client->queueGzip(response.getFile(), range.offset, range.length);
+    }
+    else if (response.hasFileBody())
+    {
+        const std::vector<Response::FileRange> &ranges = response.getFileRanges();
+        for (size_t i = 0; i < ranges.size(); ++i)
+        {
+            client->queueOutput(ranges[i].prefix);
+            client->queueFile(response.getFile(), ranges[i].offset, ranges[i].length);
+        }
+        client->queueOutput(response.getFileTrailer());
+    }
+}
+
+// Errors close the connection unless keep_connection is set, in which case the
+// keep-alive decision already made for the request stands.
+int Server::sendErrorResponse(Client *client, int status_code, const std::string &message, const ConfigParser::ServerConfig &serverConfig, bool keep_connection)
+{
+    if (!keep_connection)
+        client->setKeepAlive(false);
+    Response response = Response::buildErrorResponse(status_code, message, serverConfig);
+    queueResponse(client, response);
+    return -1;
+}
+
 int Server::prepareResponse(const requestParser &req, int client_fd)
 {
-    ConfigParser::ServerConfig serverConfig = clientToServergMap[client_fd];
+    const ConfigParser::ServerConfig &serverConfig = *slots[client_fd].server;
+    Client *client = slots[client_fd].client;
     std::string path = req.getPath();
     std::string method = req.getMethod();
     std::string version = req.getHttpVersion();
 
     // printRequest(req);
 
+    if (req.hasError())
+    {
+        if (req.getErrorStatus() == 500)
+            return sendErrorResponse(client, 500, "Internal Server Error", serverConfig);
+        if (req.getErrorStatus() == 413)
+            return sendErrorResponse(client, 413, "Payload Too Large", serverConfig);
+        if (req.getErrorStatus() == 501)
+            return sendErrorResponse(client, 501, "Not Implemented", serverConfig);
+        return sendErrorResponse(client, 400, "Bad Request", serverConfig);
+    }
+
     if (!path.empty() && !method.empty() && !version.empty())
     {
         if (version != "HTTP/1.1" && version != "HTTP/1.0")
-        {
-            send_error_response(client_fd, 505, "HTTP Version Not Supported", serverConfig);
-            return -1;
-        }
+            return sendErrorResponse(client, 505, "HTTP Version Not Supported", serverConfig);
         if(version == "HTTP/1.1" && !req.getHeaders().count("Host"))
-        {
-            send_error_response(client_fd, 400, "Bad Request", serverConfig);
-            return -1;
-        }
+            return sendErrorResponse(client, 400, "Bad Request", serverConfig);
     }
     else
-    {
-        send_error_response(client_fd, 400, "Bad Request", serverConfig);
-        return -1;
-    }
+        return sendErrorResponse(client, 400, "Bad Request", serverConfig);
+
     size_t queryPos = path.find('?');
     if (queryPos != std::string::npos)
         path = path.substr(0, queryPos);
 
-    const ConfigParser::LocationConfig *location = findMatchingLocation(serverConfig.locations, path);
+    size_t max_body_size = serverConfig.limit_client_body_size;
+
+    if (req.getBodySize() > max_body_size)
+        return sendErrorResponse(client, 413, "Payload Too Large", serverConfig);
+
+    bool keep_alive = req.isKeepAlive() && serverConfig.keepalive_timeout > 0 &&
+                      client->getRequestsServed() + 1 < serverConfig.keepalive_requests;
+    client->setKeepAlive(keep_alive);
+
+    const ConfigParser::LocationConfig *location = findMatchingLocation(serverConfig, path);
 
     if (location && !location->return_directive.empty())
     {
-        const std::string &location_url = location->return_directive;
-        send_redirect_response(client_fd, 302, location_url, "Found");
-        return -1;
+        Response response = Response::buildPrerendered(302, "Found", location->redirect_response);
+        queueResponse(client, response);
+        Utils::log("Sent 302 redirect to: " + location->return_directive, AnsiColor::BOLD_CYAN);
+        return 0;
     }
 
     if (location && !location->allowed_methods.empty())
     {
         if (std::find(location->allowed_methods.begin(), location->allowed_methods.end(), method) == location->allowed_methods.end())
-        {
-            send_error_response(client_fd, 405, "Method Not Allowed", serverConfig);
-            return -1;
-        }
+            return sendErrorResponse(client, 405, "Method Not Allowed", serverConfig, true);
     }
 
-    std::string root = serverConfig.root;
+    const std::string &root = serverConfig.root;
     std::string full_path;
     full_path = root + path;
     normalize_path(full_path);
 
-    size_t max_body_size = serverConfig.limit_client_body_size;
-
-    if (!req.getBody().empty() && req.getBody().size() > max_body_size)
+    // With fastcgi_pass, the location's cgi_map only selects which
+    // extensions go to the application; without one, every request does.
+    if (location && !location->fastcgi_pass.empty() &&
+        (location->cgi.empty() || location->cgi.count(get_file_extension(full_path))))
     {
-        send_error_response(client_fd, 413, "Payload Too Large", serverConfig);
-        return -1;
+        if (!startFastCGI(client_fd, location->fastcgi_pass, full_path))
+        {
+            Utils::log("FastCGI connection to " + location->fastcgi_pass + " failed for " + full_path, AnsiColor::BOLD_RED);
+            return sendErrorResponse(client, 502, "Bad Gateway", serverConfig);
+        }
+        Utils::log("FastCGI request for " + full_path + " method: " + method, AnsiColor::BOLD_YELLOW);
+        return 0;
     }
 
     if (location && !location->cgi.empty())
@@ -436,62 +679,55 @@ int Server::prepareResponse(const requestParser &req, int client_fd)
         {
             const std::string &interpreter = it->second;
 
-            CGIHandler cgiHandler;
-            std::string cgi_response = cgiHandler.handleCGI(full_path, req, interpreter, client_fd);
-
-            if (cgi_response.empty())
+            if (!startCGI(client_fd, full_path, interpreter))
             {
-                send_error_response(client_fd, 500, "Internal Server Error", serverConfig);
-                return -1;
+                Utils::log("CGI execution failed for " + full_path, AnsiColor::BOLD_RED);
+                return sendErrorResponse(client, 500, "Internal Server Error", serverConfig);
             }
-
-            clients[client_fd]->setResponse(cgi_response);
-            Utils::log("CGI executed for " + full_path + " method: " + method, AnsiColor::BOLD_YELLOW);
+            Utils::log("CGI started for " + full_path + " method: " + method, AnsiColor::BOLD_YELLOW);
             return 0;
         }
     }
 
-    if (access(full_path.c_str(), F_OK) == -1)
-    {
-        send_error_response(client_fd, 404, "Not Found", serverConfig);
-        return -1;
-    }
+    // Handed on to buildGetResponse() so the path is looked up only once.
+    const OpenFileCache::Entry &file = fileCache.lookup(full_path);
+    if (file.error == ENOENT || file.error == ENOTDIR)
+        return sendErrorResponse(client, 404, "Not Found", serverConfig, true);
 
     Response response;
     bool autoindex = location ? location->autoindex : false;
     if (method == "GET")
     {
-        response = Response::buildGetResponse(req, full_path, autoindex, client_fd, serverConfig);
+        response = Response::buildGetResponse(req, full_path, file, autoindex, serverConfig, fileCache, staticCache, gzipCache);
     }
     else if (method == "POST")
     {
-        response = Response::buildPostResponse(req, full_path, client_fd, serverConfig);
+        response = Response::buildPostResponse(req, full_path, serverConfig);
     }
     else if (method == "DELETE")
     {
-        response = Response::buildDeleteResponse(req, full_path, client_fd, serverConfig);
+        response = Response::buildDeleteResponse(req, full_path, serverConfig);
     }
     else
+        return sendErrorResponse(client, 405, "Method Not Allowed", serverConfig);
+
+    // Uploads and deletions must be visible to the very next request, which
+    // may already be pipelined behind this one.
+    if (method != "GET")
     {
-        send_error_response(client_fd, 405, "Method Not Allowed", serverConfig);
-        return -1;
+        fileCache.invalidate(full_path);
+        fileCache.processEvents();
     }
 
-    std::string response_str = response.toString();
     Utils::log("Method: " + req.getMethod() + ", Path: " + req.getPath() + ", Status Code: " + to_string_c98(response.getStatusCode()), AnsiColor::BOLD_YELLOW);
-    clients[client_fd]->setResponse(response_str);
+    queueResponse(client, response);
     return 0;
 }
 
 void Server::handleClientRead(int client_fd)
 {
-    if (clients.find(client_fd) == clients.end())
-    {
-        closeClientConnection(client_fd);
-        return;
-    }
-
-    char buffer[4096];
+    Client *client = slots[client_fd].client;
+    char buffer[65536];
     ssize_t bytes_read;
 
     while (true)
@@ -500,7 +736,7 @@ void Server::handleClientRead(int client_fd)
 
         if (bytes_read > 0)
         {
-            clients[client_fd]->appendToBuffer(std::string(buffer, bytes_read));
+            client->appendToBuffer(buffer, bytes_read);
         }
         else if (bytes_read == 0)
         {
@@ -513,254 +749,768 @@ void Server::handleClientRead(int client_fd)
         }
     }
 
-    if (clients[client_fd]->processRequest())
+    processClientRequest(client_fd);
+    if (slots[client_fd].type == SLOT_CLIENT)
+        updateReadTimer(client_fd);
+}
+
+bool Server::setClientEvents(int client_fd, uint32_t events)
+{
+    struct epoll_event event;
+    event.events = events | EPOLLET;
+    event.data.ptr = &slots[client_fd];
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_fd, &event) == -1)
     {
-        const requestParser &request = clients[client_fd]->getRequest();
+        perror("epoll_ctl: client_fd");
+        closeClientConnection(client_fd);
+        return false;
+    }
+    return true;
+}
+
+// Handles every complete request sitting in the client's buffer. Responses are
+// written straight away; only when the socket would block do we switch the
+// connection to EPOLLOUT and let handleClientWrite finish the job. While a CGI
+// script runs, later pipelined requests wait in the buffer.
+void Server::processClientRequest(int client_fd)
+{
+    Client *client = slots[client_fd].client;
 
-        if (prepareResponse(request, client_fd) == -1)
+    while (!client->getCGI())
+    {
+        if (!client->processRequest())
         {
-            closeClientConnection(client_fd);
-            return;
+            if (client->getRequest().getState() != requestParser::HEADERS_COMPLETE)
+                return;
+            selectServer(client_fd);
+            if (startRequestBody(client_fd))
+                continue;
+        }
+        else
+        {
+            selectServer(client_fd);
+            prepareResponse(client->getRequest(), client_fd);
+            if (client->getCGI())
+                return;
         }
 
-        struct epoll_event event;
-        event.events = EPOLLOUT | EPOLLET;
-        event.data.fd = client_fd;
-        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_fd, &event);
+        if (!flushResponse(client_fd))
+            return;
+    }
+}
+
+// Writes what is queued for the client. Returns true once the response is
+// fully sent and the connection is ready for its next request.
+bool Server::flushResponse(int client_fd)
+{
+    int status = slots[client_fd].client->flushOutput();
+    if (status == -1)
+    {
+        closeClientConnection(client_fd);
+        return false;
+    }
+    if (status == 0)
+    {
+        if (setClientEvents(client_fd, EPOLLOUT))
+            armTimer(client_fd, SEND_TIMEOUT);
+        return false;
+    }
+    return finishResponse(client_fd);
+}
+
+// Routes the request to the server block named by its Host header, among
+// those listening on the socket the connection came in on.
+void Server::selectServer(int client_fd)
+{
+    Slot &slot = slots[client_fd];
+    if (slot.hosts->size() > 1)
+        slot.server = &slot.hosts->select(slot.client->getRequest().getHeader("Host"));
+}
+
+// Runs once the headers of a request with a body are parsed, before any body
+// byte is read: oversized bodies are refused here instead of being buffered.
+// A chunked body has no length up front; the parser enforces the limit on it
+// as it is decoded.
+bool Server::startRequestBody(int client_fd)
+{
+    Client *client = slots[client_fd].client;
+    const ConfigParser::ServerConfig &serverConfig = *slots[client_fd].server;
+    const requestParser &req = client->getRequest();
+
+    if (req.getContentLength() > serverConfig.limit_client_body_size)
+    {
+        sendErrorResponse(client, 413, "Payload Too Large", serverConfig);
+        return false;
+    }
+
+    std::string expect = req.getHeader("Expect");
+    std::transform(expect.begin(), expect.end(), expect.begin(), ::tolower);
+    if (expect == "100-continue" && req.getHttpVersion() == "HTTP/1.1")
+    {
+        client->queueOutput("HTTP/1.1 100 Continue\r\n\r\n");
+        client->flushOutput();
+    }
+
+    client->beginRequestBody(serverConfig.client_body_buffer_size, serverConfig.limit_client_body_size);
+    return true;
+}
+
+// Called once a response has been fully written. Returns false if the
+// connection was closed.
+bool Server::finishResponse(int client_fd)
+{
+    Client *client = slots[client_fd].client;
+
+    Utils::log("Sent response to client fd: " + to_string_c98(client_fd), AnsiColor::BOLD_BLUE);
+    if (!client->isKeepAlive())
+    {
+        closeClientConnection(client_fd);
+        return false;
     }
+
+    client->clearResponse();
+    armTimer(client_fd, IDLE_TIMEOUT);
+    return true;
 }
 
 void Server::handleClientWrite(int client_fd)
 {
-    if (clients.find(client_fd) == clients.end())
+    Client *client = slots[client_fd].client;
+    int status = client->flushOutput();
+    if (status == -1)
     {
         closeClientConnection(client_fd);
         return;
     }
+    if (status == 0)
+    {
+        armTimer(client_fd, SEND_TIMEOUT);
+        return;
+    }
+
+    // Caught up with a script that is still streaming its output
+    if (client->getCGI())
+    {
+        if (setClientEvents(client_fd, EPOLLIN))
+            resumeCGIOutput(client_fd);
+        return;
+    }
 
-    Client *client = clients[client_fd];
-    const std::string &response = client->getResponse();
+    if (!finishResponse(client_fd) || !setClientEvents(client_fd, EPOLLIN))
+        return;
 
-    write(client_fd, response.c_str(), response.size());
-    Utils::log("Sending response to client fd: " + to_string_c98(client_fd), AnsiColor::BOLD_BLUE);
-    client->clearResponse();
-    closeClientConnection(client_fd);
+    // A pipelined request may already be buffered; with edge-triggered epoll
+    // no new EPOLLIN will arrive for it, so handle it right away.
+    if (client->hasPendingData())
+        processClientRequest(client_fd);
 }
 
+bool Server::startCGI(int client_fd, const std::string &scriptPath, const std::string &interpreter)
+{
+    Client *client = slots[client_fd].client;
+    CGIHandler *cgi = new CGIHandler();
 
-void Server::handleConnections()
+    if (!cgi->start(scriptPath, client->getRequest(), interpreter))
+    {
+        delete cgi;
+        return false;
+    }
+    client->setCGI(cgi);
+    cgi_pids[cgi->getPid()] = client_fd;
+    armTimer(client_fd, CGI_TIMEOUT);
+
+    if ((cgi->getStdinFd() != -1 && !watchCGIFd(cgi->getStdinFd(), EPOLLOUT, client_fd)) ||
+        !watchCGIFd(cgi->getStdoutFd(), EPOLLIN, client_fd))
+    {
+        abortCGI(client_fd);
+        return false;
+    }
+    return true;
+}
+
+// CGI pipes stay level-triggered and map back to the client they serve.
+bool Server::watchCGIFd(int fd, uint32_t events, int client_fd)
 {
-    signal(SIGINT, sighandler);
-    signal(SIGQUIT, sighandler);
+    if (!watchFd(fd, events, SLOT_CGI_PIPE))
+    {
+        perror("epoll_ctl: cgi pipe");
+        return false;
+    }
+    slots[fd].owner = client_fd;
+    return true;
+}
 
-    struct epoll_event events[MAX_EVENTS];
+void Server::unwatchCGIFd(int fd)
+{
+    if (fd == -1 || slots[fd].type != SLOT_CGI_PIPE)
+        return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    slots[fd].clear();
+}
 
-    while (!_turnoff)
+void Server::handleCGIEvent(int fd)
+{
+    int client_fd = slots[fd].owner;
+    CGIHandler *cgi = slots[client_fd].client->getCGI();
+
+    if (fd == cgi->getStdinFd())
     {
-        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
-        if (num_events == -1)
+        if (cgi->writeInput() != 0)
         {
-            if (errno == EINTR)
-            {
-                continue;
-            }
-            perror("epoll_wait");
-            break;
+            unwatchCGIFd(fd);
+            cgi->closeStdin();
         }
+        return;
+    }
 
-        for (int i = 0; i < num_events; ++i)
+    int status = cgi->readOutput();
+    if (status != 0)
+    {
+        unwatchCGIFd(fd);
+        cgi->closeStdout();
+        if (status == -1)
+            cgi->terminate();
+    }
+
+    if (cgi->isFinished())
+        finishCGI(client_fd);
+    else
+        streamCGIOutput(client_fd);
+}
+
+// Sends the head as soon as the script's header block is in, then whatever
+// body it has written since. When the client cannot keep up, the script's
+// stdout is left unwatched until handleClientWrite() has sent everything
+// queued, so a connection holds at most one event's worth of output and the
+// script blocks on its pipe meanwhile. Once streaming, cgi_timeout bounds the
+// silence between two writes of the script instead of its whole run.
+void Server::streamCGIOutput(int client_fd)
+{
+    Client *client = slots[client_fd].client;
+    CGIHandler *cgi = client->getCGI();
+
+    if (!cgi->isStreaming())
+    {
+        Response head;
+        if (!cgi->beginStream(client->getRequest(), *slots[client_fd].server, head))
+            return;
+        head.addHeader("Connection", client->isKeepAlive() ? "keep-alive" : "close");
+        head.serializeHead(client->queueBuffer());
+    }
+    cgi->takeBody(client->queueBuffer());
+    armTimer(client_fd, CGI_TIMEOUT);
+
+    int status = client->flushOutput();
+    if (status == -1)
+    {
+        closeClientConnection(client_fd);
+        return;
+    }
+    if (status == 0 && setClientEvents(client_fd, EPOLLOUT))
+    {
+        unwatchCGIFd(cgi->getStdoutFd());
+        // A FastCGI connection is only paused while it serves this client alone
+        FastCGIConnection *conn = cgi->getFastCGI();
+        if (conn && conn->getRequestCount() == 1)
         {
-            int fd = events[i].data.fd;
+            conn->setPaused(true);
+            updateFastCGIEvents(conn);
+        }
+        armTimer(client_fd, SEND_TIMEOUT);
+    }
+}
 
-            if (server_fds.find(fd) != server_fds.end())
-            {
-                acceptNewConnection(fd);
-            }
-            else if (events[i].events & EPOLLIN)
-            {
-                handleClientRead(fd);
-            }
-            else if (events[i].events & EPOLLOUT)
-            {
-                handleClientWrite(fd);
-            }
+// The client has taken everything queued: read the script's output again.
+bool Server::resumeCGIOutput(int client_fd)
+{
+    CGIHandler *cgi = slots[client_fd].client->getCGI();
+    int fd = cgi->getStdoutFd();
+    if (fd != -1 && slots[fd].type == SLOT_FREE && !watchCGIFd(fd, EPOLLIN, client_fd))
+    {
+        closeClientConnection(client_fd);
+        return false;
+    }
+    FastCGIConnection *conn = cgi->getFastCGI();
+    if (conn && conn->isPaused())
+    {
+        conn->setPaused(false);
+        updateFastCGIEvents(conn);
+    }
+    armTimer(client_fd, CGI_TIMEOUT);
+    return true;
+}
+
+// Passes the request to the FastCGI application at address, over one of its
+// connections with room for another request or else a new one. The request
+// then runs like a CGI script whose output arrives through
+// handleFastCGIEvent() instead of a pipe.
+bool Server::startFastCGI(int client_fd, const std::string &address, const std::string &scriptPath)
+{
+    FastCGIConnection *conn = NULL;
+    for (size_t i = 0; i < fastcgiConnections.size() && !conn; ++i)
+    {
+        if (fastcgiConnections[i]->getAddress() == address && fastcgiConnections[i]->hasRoom())
+            conn = fastcgiConnections[i];
+    }
+    bool opened = !conn;
+    if (!conn)
+    {
+        conn = FastCGIConnection::open(address);
+        if (!conn)
+            return false;
+        if (!watchFd(conn->getFd(), EPOLLIN | EPOLLOUT, SLOT_FASTCGI))
+        {
+            perror("epoll_ctl: fastcgi");
+            delete conn;
+            return false;
         }
+        slots[conn->getFd()].fastcgi = conn;
+        fastcgiConnections.push_back(conn);
     }
+
+    Client *client = slots[client_fd].client;
+    const requestParser &request = client->getRequest();
+    std::map<std::string, std::string> params = CGIHandler::prepareCGIEnv(request);
+    // The application runs elsewhere and cannot resolve a relative root
+    char cwd[PATH_MAX];
+    if (scriptPath[0] != '/' && getcwd(cwd, sizeof(cwd)))
+        params["SCRIPT_FILENAME"] = std::string(cwd) + "/" + scriptPath;
+    else
+        params["SCRIPT_FILENAME"] = scriptPath;
+    params["REQUEST_URI"] = request.getPath();
+
+    unsigned short id = conn->beginRequest(client_fd, params, request);
+    // Nothing may stay attached when the caller answers 502 instead
+    if (!updateFastCGIEvents(conn))
+    {
+        conn->abortRequest(id);
+        if (opened)
+            closeFastCGI(conn);
+        return false;
+    }
+
+    CGIHandler *cgi = new CGIHandler();
+    cgi->attachFastCGI(conn, id);
+    client->setCGI(cgi);
+    armTimer(client_fd, CGI_TIMEOUT);
+    return true;
 }
 
-void Server::Cleanup()
+// Reads what the application sent and writes what is queued for it, then
+// hands each request's output to its client. Clients are served as their
+// output arrives. A slow client pauses the connection like it unwatches a
+// script's pipe, but only while it is the connection's sole request: pausing
+// a shared one would hold back every other request on it, so there a slow
+// client's output waits in its own queue instead, bounded by send_timeout. A
+// connection that fails takes its requests down with it.
+void Server::handleFastCGIEvent(int fd, uint32_t events)
 {
-    if (!clients.empty())
+    FastCGIConnection *conn = slots[fd].fastcgi;
+    std::vector<FastCGIConnection::Output> outputs;
+    bool ok = true;
+
+    if (conn->isConnecting() && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        ok = conn->finishConnect();
+    if (ok && !conn->isConnecting() && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        ok = conn->receive(outputs);
+    if (ok)
+        ok = conn->flush() != -1;
+
+    // Dropped before any output is delivered, since finishing a request may
+    // start the client's next one on the same application. The handlers let
+    // go of the connection before it is freed: delivering output below can
+    // still pause, abort or close them.
+    std::vector<int> failed;
+    if (!ok)
     {
-        for (std::map<int, Client *>::iterator iter = clients.begin(); iter != clients.end(); ++iter)
+        conn->failRequests(failed);
+        for (size_t i = 0; i < failed.size(); ++i)
         {
-            if (iter->first >= 0)
-                close(iter->first);
+            if (slots[failed[i]].type == SLOT_CLIENT && slots[failed[i]].client->getCGI())
+                slots[failed[i]].client->getCGI()->detachFastCGI();
+        }
+        Utils::log("FastCGI connection to " + conn->getAddress() + " lost" +
+                       (failed.empty() ? "" : ", failing " + to_string_c98(failed.size()) + " requests"),
+                   failed.empty() ? AnsiColor::BOLD_CYAN : AnsiColor::BOLD_RED);
+        closeFastCGI(conn);
+    }
+    else
+        updateFastCGIEvents(conn);
 
-            if (iter->second != NULL)
-                delete iter->second;
+    for (size_t i = 0; i < outputs.size(); ++i)
+    {
+        int client_fd = outputs[i].client_fd;
+        if (slots[client_fd].type != SLOT_CLIENT || !slots[client_fd].client->getCGI())
+            continue;
+        CGIHandler *cgi = slots[client_fd].client->getCGI();
+        cgi->appendOutput(outputs[i].data);
+        if (outputs[i].ended)
+        {
+            cgi->detachFastCGI();
+            cgi->endOutput(outputs[i].app_status);
+            finishCGI(client_fd);
         }
-        clients.clear();
+        else
+            streamCGIOutput(client_fd);
     }
-    if (epoll_fd >= 0 && epoll_fd != -1)
+    for (size_t i = 0; i < failed.size(); ++i)
     {
-        close(epoll_fd);
+        if (slots[failed[i]].type != SLOT_CLIENT || !slots[failed[i]].client->getCGI())
+            continue;
+        CGIHandler *cgi = slots[failed[i]].client->getCGI();
+        cgi->endOutput(-1);
+        finishCGI(failed[i]);
+    }
+
+    if (!ok || !conn->isIdle())
+        return;
+    size_t idle = 0;
+    for (size_t i = 0; i < fastcgiConnections.size(); ++i)
+    {
+        if (fastcgiConnections[i]->getAddress() == conn->getAddress() && fastcgiConnections[i]->isIdle())
+            ++idle;
+    }
+    if (idle > MAX_IDLE_FASTCGI)
+        closeFastCGI(conn);
+}
+
+// Writable events are only asked for while something waits to be sent, and
+// readable ones not while the connection is paused.
+bool Server::updateFastCGIEvents(FastCGIConnection *conn)
+{
+    struct epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = 0;
+    if (!conn->isPaused())
+        ev.events |= EPOLLIN;
+    if (conn->wantsWrite())
+        ev.events |= EPOLLOUT;
+    ev.data.ptr = &slots[conn->getFd()];
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->getFd(), &ev) == -1)
+    {
+        perror("epoll_ctl: fastcgi");
+        return false;
     }
+    return true;
+}
+
+void Server::closeFastCGI(FastCGIConnection *conn)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->getFd(), NULL);
+    slots[conn->getFd()].clear();
+    fastcgiConnections.erase(std::find(fastcgiConnections.begin(), fastcgiConnections.end(), conn));
+    delete conn;
+}
+
+void Server::reapChildren()
+{
+    char buffer[64];
+    while (read(sigchld_pipe[0], buffer, sizeof(buffer)) > 0)
+        ;
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        std::map<pid_t, int>::iterator it = cgi_pids.find(pid);
+        if (it == cgi_pids.end())
+            continue;
+        int client_fd = it->second;
+        cgi_pids.erase(it);
+        if (client_fd == -1)
+            continue;
+
+        CGIHandler *cgi = slots[client_fd].client->getCGI();
+        cgi->setExitStatus(status);
+        if (cgi->isFinished())
+            finishCGI(client_fd);
+    }
+}
 
-    if (!server_fds.empty())
+// The script has exited and its output is drained: answer the request, or
+// end the body already being streamed, and carry on with whatever the client
+// pipelined meanwhile.
+void Server::finishCGI(int client_fd)
+{
+    Client *client = slots[client_fd].client;
+    CGIHandler *cgi = client->getCGI();
+
+    if (cgi->isStreaming())
     {
-        for (std::set<int>::iterator it = server_fds.begin(); it != server_fds.end(); ++it)
+        std::string &tail = client->queueBuffer();
+        cgi->takeBody(tail);
+        bool complete = cgi->finishStream(tail);
+        client->clearCGI();
+        Utils::log("CGI finished for client fd: " + to_string_c98(client_fd) + (complete ? ", stream complete" : ", stream cut short"), AnsiColor::BOLD_YELLOW);
+        if (!complete)
         {
-            if (*it >= 0)
-                close(*it);
+            closeClientConnection(client_fd);
+            return;
         }
-        server_fds.clear();
     }
+    else
+    {
+        Response response = cgi->buildResponse(*slots[client_fd].server);
+        client->clearCGI();
 
-    if (!serverConfigMap.empty())
-        serverConfigMap.clear();
+        if (response.getStatusCode() >= 500)
+            client->setKeepAlive(false);
+        Utils::log("CGI finished for client fd: " + to_string_c98(client_fd) + ", Status Code: " + to_string_c98(response.getStatusCode()), AnsiColor::BOLD_YELLOW);
+        queueResponse(client, response);
+    }
 
-    if (!clientToServergMap.empty())
-        clientToServergMap.clear();
+    if (flushResponse(client_fd) && client->hasPendingData())
+        processClientRequest(client_fd);
 }
 
-void send_http_headers(int client_fd, const std::string &status_line,
-                       const std::string &content_type, size_t content_length,
-                       const std::string &connection_header = "close")
+// Kills the client's running script, if any, without answering the request.
+void Server::abortCGI(int client_fd)
 {
-    std::ostringstream oss;
-    oss << status_line << "\r\n"
-        << "Content-Type: " << content_type << "\r\n"
-        << "Content-Length: " << content_length << "\r\n"
-        << "Connection: " << connection_header << "\r\n\r\n";
+    Client *client = slots[client_fd].client;
+    CGIHandler *cgi = client->getCGI();
+    if (!cgi)
+        return;
+
+    unwatchCGIFd(cgi->getStdinFd());
+    unwatchCGIFd(cgi->getStdoutFd());
+
+    // The application is told to stop; the connection stays usable.
+    if (cgi->getFastCGI())
+    {
+        cgi->getFastCGI()->abortRequest(cgi->getRequestId());
+        cgi->getFastCGI()->setPaused(false);
+        updateFastCGIEvents(cgi->getFastCGI());
+    }
+
+    // Nobody waits for the result any more, but the child is still reaped.
+    std::map<pid_t, int>::iterator it = cgi_pids.find(cgi->getPid());
+    if (it != cgi_pids.end())
+        it->second = -1;
 
-    std::string header_response = oss.str();
-    write(client_fd, header_response.c_str(), header_response.length());
+    cgi->terminate();
+    client->clearCGI();
 }
 
-std::string to_string_c98(size_t val)
+// Each connection has a single timer, re-armed for whatever it waits on next.
+void Server::armTimer(int client_fd, TimeoutType type)
 {
-    std::ostringstream oss;
-    oss << val;
-    return oss.str();
+    const ConfigParser::ServerConfig &serverConfig = *slots[client_fd].server;
+    int seconds = serverConfig.keepalive_timeout;
+
+    if (type == HEADER_TIMEOUT)
+        seconds = serverConfig.client_header_timeout;
+    else if (type == BODY_TIMEOUT)
+        seconds = serverConfig.client_body_timeout;
+    else if (type == SEND_TIMEOUT)
+        seconds = serverConfig.send_timeout;
+    else if (type == CGI_TIMEOUT)
+        seconds = serverConfig.cgi_timeout;
+
+    timers.arm(slots[client_fd].client->getTimer(), client_fd, type, seconds * 1000L);
 }
 
-void send_error_response(int client_fd, int status_code, const std::string &message, const ConfigParser::ServerConfig &serverConfig)
-{
-
-    std::string status_text;
-    std::string error_page_path;
-
-    switch (status_code)
-    {
-    case 400:
-        status_text = "Bad Request";
-        break;
-    case 403:
-        status_text = "Forbidden";
-        break;
-    case 404:
-        status_text = "Not Found";
-        break;
-    case 405:
-        status_text = "Method Not Allowed";
-        break;
-    case 413:
-        status_text = "Payload Too Large";
-        break;
-    case 500:
-        status_text = "Internal Server Error";
-        break;
-    case 504:
-        status_text = "Gateway Timeout";
-        break;
-    case 505:
-        status_text = "HTTP Version Not Supported";
-        break;
-    default:
-        status_text = "Error";
-        break;
-    }
-
-    std::map<int, std::string>::const_iterator it = serverConfig.error_pages.find(status_code);
-    if (it != serverConfig.error_pages.end())
-    {
-        error_page_path = serverConfig.root + it->second;
+// After a read: the body timeout restarts on every read, while the header
+// timeout bounds the whole request head from its first byte.
+void Server::updateReadTimer(int client_fd)
+{
+    Client *client = slots[client_fd].client;
+    if (client->getCGI() || client->hasPendingOutput())
+        return;
+
+    requestParser::State state = client->getRequest().getState();
+    if (state == requestParser::BODY)
+        armTimer(client_fd, BODY_TIMEOUT);
+    else if ((state != requestParser::REQUEST_LINE || client->hasPendingData()) &&
+             client->getTimer()->type != HEADER_TIMEOUT)
+        armTimer(client_fd, HEADER_TIMEOUT);
+}
+
+void Server::expireTimers()
+{
+    std::vector<TimerWheel::Timer *> expired;
+    timers.expire(expired);
+
+    std::vector<std::pair<int, int> > due;
+    for (size_t i = 0; i < expired.size(); ++i)
+        due.push_back(std::make_pair(expired[i]->fd, expired[i]->type));
+
+    for (size_t i = 0; i < due.size(); ++i)
+    {
+        if (slots[due[i].first].type == SLOT_CLIENT)
+            handleTimeout(due[i].first, due[i].second);
+    }
+}
+
+void Server::handleTimeout(int client_fd, int type)
+{
+    Client *client = slots[client_fd].client;
+    const ConfigParser::ServerConfig &serverConfig = *slots[client_fd].server;
+
+    if (type == CGI_TIMEOUT)
+    {
+        Utils::log("CGI script timed out for client fd: " + to_string_c98(client_fd), AnsiColor::BOLD_RED);
+        // Too late for a 504 once the head has gone out
+        if (client->getCGI()->isStreaming())
+        {
+            closeClientConnection(client_fd);
+            return;
+        }
+        abortCGI(client_fd);
+        sendErrorResponse(client, 504, "Gateway Timeout", serverConfig);
+        flushResponse(client_fd);
+    }
+    else if (type == HEADER_TIMEOUT || type == BODY_TIMEOUT)
+    {
+        Utils::log("Request timeout for client fd: " + to_string_c98(client_fd), AnsiColor::BOLD_MAGENTA);
+        sendErrorResponse(client, 408, "Request Timeout", serverConfig);
+        flushResponse(client_fd);
     }
     else
     {
-        if (status_code == 404)
-            error_page_path = "./www/epages/404.html";
-        else if (status_code == 500)
-            error_page_path = "./www/epages/500.html";
-        else if (status_code == 403)
-            error_page_path = "./www/epages/403.html";
-        else if (status_code == 400)
-            error_page_path = "./www/epages/400.html";
-        else if (status_code == 405)
-            error_page_path = "./www/epages/405.html";
-        else if (status_code == 413)
-            error_page_path = "./www/epages/413.html";
-        else if (status_code == 504)
-            error_page_path = "./www/epages/504.html";
-        else if (status_code == 505)
-            error_page_path = "./www/epages/505.html";
+        if (type == SEND_TIMEOUT)
+            Utils::log("Send timeout for client fd: " + to_string_c98(client_fd), AnsiColor::BOLD_MAGENTA);
         else
-            error_page_path = "./www/epages/500.html";
+            Utils::log("Keep-alive timeout for client fd: " + to_string_c98(client_fd), AnsiColor::BOLD_MAGENTA);
+        closeClientConnection(client_fd);
     }
+}
 
-    std::string response_body = "";
+void Server::handleConnections()
+{
+    signal(SIGINT, sighandler);
+    signal(SIGQUIT, sighandler);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
 
-    int error_fd = open(error_page_path.c_str(), O_RDONLY);
-    if (error_fd >= 0)
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!_turnoff)
     {
-        struct stat st;
-        if (fstat(error_fd, &st) == 0 && st.st_size > 0)
+        int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timers.nextTimeout());
+        if (num_events == -1)
         {
-            response_body.resize(st.st_size);
-            ssize_t bytesRead = read(error_fd, &response_body[0], st.st_size);
-            if (bytesRead <= 0 || response_body.find_first_not_of(" \t\n\r") == std::string::npos)
+            if (errno == EINTR)
             {
-                response_body = "<!DOCTYPE html><html><head><title>Error " + to_string_c98(status_code) +
-                                "</title></head><body><h1>Error " + to_string_c98(status_code) + ": " +
-                                status_text + "</h1><p>" + message + "</p></body></html>";
+                continue;
             }
+            perror("epoll_wait");
+            break;
         }
-        else
+
+        for (int i = 0; i < num_events; ++i)
+        {
+            const Slot *slot = static_cast<const Slot *>(events[i].data.ptr);
+            int fd = slot->fd;
+
+            // A slot freed by an earlier event of this batch is skipped.
+            if (slot->type == SLOT_LISTENER)
+            {
+                acceptNewConnection(fd);
+            }
+            else if (slot->type == SLOT_SIGCHLD)
+            {
+                reapChildren();
+            }
+            else if (slot->type == SLOT_INOTIFY)
+            {
+                fileCache.processEvents();
+            }
+            else if (slot->type == SLOT_CGI_PIPE)
+            {
+                handleCGIEvent(fd);
+            }
+            else if (slot->type == SLOT_FASTCGI)
+            {
+                handleFastCGIEvent(fd, events[i].events);
+            }
+            else if (slot->type != SLOT_CLIENT)
+            {
+                continue;
+            }
+            else if (events[i].events & EPOLLIN)
+            {
+                handleClientRead(fd);
+            }
+            else if (events[i].events & EPOLLOUT)
+            {
+                handleClientWrite(fd);
+            }
+        }
+
+        expireTimers();
+    }
+}
+
+void Server::Cleanup()
+{
+    for (size_t i = 0; i < slots.size(); ++i)
+    {
+        if (slots[i].type == SLOT_CLIENT)
         {
-            response_body = "<!DOCTYPE html><html><head><title>Error " + to_string_c98(status_code) +
-                            "</title></head><body><h1>Error " + to_string_c98(status_code) + ": " +
-                            status_text + "</h1><p>" + message + "</p></body></html>";
+            close(slots[i].fd);
+            delete slots[i].client;
+            config->release();
         }
-        close(error_fd);
+        slots[i].clear();
     }
-    else
+    for (size_t i = 0; i < spareClients.size(); ++i)
+        delete spareClients[i];
+    spareClients.clear();
+    for (size_t i = 0; i < fastcgiConnections.size(); ++i)
+        delete fastcgiConnections[i];
+    fastcgiConnections.clear();
+    // Cleared so the destructor does not close a number that a worker may
+    // have reused by then
+    if (epoll_fd != -1)
+    {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+
+    if (_sigchld_fd != -1)
     {
-        response_body = "<!DOCTYPE html><html><head><title>Error " + to_string_c98(status_code) +
-                        "</title></head><body><h1>Error " + to_string_c98(status_code) + ": " +
-                        status_text + "</h1><p>" + message + "</p></body></html>";
+        _sigchld_fd = -1;
+        close(sigchld_pipe[0]);
+        close(sigchld_pipe[1]);
+    }
+    cgi_pids.clear();
+    fileCache.clear();
+    if (staticCache.isEnabled())
+        Utils::log("Static cache: " + to_string_c98(staticCache.getHits()) + " hits, " + to_string_c98(staticCache.getMisses()) + " misses", AnsiColor::BOLD_CYAN);
+    staticCache.clear();
+    if (gzipCache.isEnabled())
+        Utils::log("Gzip cache: " + to_string_c98(gzipCache.getHits()) + " hits, " + to_string_c98(gzipCache.getMisses()) + " misses", AnsiColor::BOLD_CYAN);
+    gzipCache.clear();
+
+    for (size_t i = 0; i < listeners.size(); ++i)
+    {
+        const Listener &listener = listeners[i];
+        Utils::log("Listener " + listener.address + ": " + to_string_c98(listener.accepted) + " accepted, accept queue peak " +
+                       to_string_c98(listener.peak_queue) + "/" + to_string_c98(listener.queue_limit) + ", full on " +
+                       to_string_c98(listener.full_wakeups) + " wakeups, " + to_string_c98(listener.capped_wakeups) +
+                       " wakeups capped",
+                   AnsiColor::BOLD_CYAN);
+        close(listener.fd);
+    }
+    listeners.clear();
+
+    virtualHosts.clear();
+    if (config)
+    {
+        config->release();
+        config = NULL;
     }
-    send_http_headers(client_fd, "HTTP/1.1 " + to_string_c98(status_code) + " " + status_text,
-                      "text/html", response_body.length());
-    write(client_fd, response_body.c_str(), response_body.length());
 }
 
-void send_redirect_response(int client_fd, int status_code, const std::string &location_url, const std::string &status_text)
+std::string to_string_c98(size_t val)
 {
-    std::string response_body = "<!DOCTYPE html><html><head><title>" + to_string_c98(status_code) + " " + status_text +
-                                "</title></head><body><h1>" + status_text + "</h1><p>The document has moved <a href=\"" +
-                                location_url + "\">here</a>.</p></body></html>";
-
     std::ostringstream oss;
-    oss << "HTTP/1.1 " << status_code << " " << status_text << "\r\n"
-        << "Location: " << location_url << "\r\n"
-        << "Content-Type: text/html\r\n"
-        << "Content-Length: " << response_body.length() << "\r\n"
-        << "Connection: close\r\n\r\n"
-        << response_body;
-
-    std::string response = oss.str();
-    write(client_fd, response.c_str(), response.length());
-
-    Utils::log("Sent " + to_string_c98(status_code) + " redirect to: " + location_url, AnsiColor::BOLD_CYAN);
-}
\ No newline at end of file
+    oss << val;
+    return oss.str();
+}
@@ -6,49 +6,160 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
 #include "./Parser/ConfigParser.hpp"
+#include "./Parser/ConfigSnapshot.hpp"
 #include "./Client/Client.hpp"
 #include "../Request/Request.hpp"
 #include "../Response/Response.hpp"
 #include "../Utils/AnsiColor.hpp"
 #include "../Utils/Logger.hpp"
+#include "TimerWheel.hpp"
+#include "VirtualHosts.hpp"
+#include "OpenFileCache.hpp"
+#include "StaticCache.hpp"
+#include "../CGI/FastCGI.hpp"
+
+class Response;
 
 class Server
 {
 private:
+    // What a descriptor registered with epoll is used for.
+    enum SlotType
+    {
+        SLOT_FREE,
+        SLOT_LISTENER,
+        SLOT_CLIENT,
+        SLOT_CGI_PIPE,
+        SLOT_FASTCGI,
+        SLOT_SIGCHLD,
+        SLOT_INOTIFY
+    };
+
+    // Per-descriptor state, indexed by fd. The epoll data of every
+    // registered descriptor points at its slot.
+    struct Slot
+    {
+        int fd;
+        SlotType type;
+        Client *client;
+        // Server blocks of a listener and its clients, and the one chosen
+        // for a client's current request.
+        const VirtualHosts *hosts;
+        const ConfigParser::ServerConfig *server;
+        // The client a CGI pipe belongs to, the index of a listener.
+        int owner;
+        // The connection behind a FastCGI socket.
+        FastCGIConnection *fastcgi;
+
+        Slot();
+        void clear();
+    };
+
+    // A listening socket and what its accept queue went through, as sampled
+    // from TCP_INFO on every wakeup.
+    struct Listener
+    {
+        int fd;
+        std::string address;
+        size_t accepted;
+        unsigned queue_limit;
+        unsigned peak_queue;
+        // Wakeups that found the queue full, so the kernel may have been
+        // dropping connection attempts, and wakeups that left connections
+        // queued after MAX_ACCEPTS.
+        size_t full_wakeups;
+        size_t capped_wakeups;
+        // Its clients cork responses that end in a file.
+        bool nopush;
+
+        Listener(int socket, const std::string &addr);
+    };
+
+    // Upper bound on the slot table when RLIMIT_NOFILE allows more.
+    static const size_t MAX_SLOTS = 65536;
+    // Connections accepted per wakeup of a listener before other ready
+    // descriptors get their turn.
+    static const int MAX_ACCEPTS = 64;
+    // Idle connections kept open per FastCGI application.
+    static const size_t MAX_IDLE_FASTCGI = 8;
+
     int epoll_fd;
-    std::map<int, Client *> clients;
+    std::vector<Slot> slots;
+    std::vector<Client *> spareClients;
     static const int MAX_EVENTS = 64;
-    std::set<int> server_fds;
-    std::map<int, std::vector<ConfigParser::ServerConfig> > serverConfigMap;
-    std::map<int, ConfigParser::ServerConfig> clientToServergMap;
+    std::vector<Listener> listeners;
+    std::map<int, VirtualHosts> virtualHosts;
+    ConfigSnapshot *config;
+    std::map<pid_t, int> cgi_pids;
+    std::vector<FastCGIConnection *> fastcgiConnections;
+    int sigchld_pipe[2];
+    TimerWheel timers;
+    OpenFileCache fileCache;
+    StaticCache staticCache;
+    StaticCache gzipCache;
 
 public:
+    // What a connection's timer is currently waiting for.
+    enum TimeoutType
+    {
+        IDLE_TIMEOUT,
+        HEADER_TIMEOUT,
+        BODY_TIMEOUT,
+        SEND_TIMEOUT,
+        CGI_TIMEOUT
+    };
+
     Server();
     ~Server();
 
     static volatile sig_atomic_t _turnoff;
+    static int _sigchld_fd;
 
-    void setupServers(const ConfigParser &parser);
+    void setupServers(const ConfigParser &parser, bool reuse_port = false);
+    bool watchFd(int fd, uint32_t events, SlotType type);
     void handleConnections();
     void acceptNewConnection(int server_fd);
+    void openClientConnection(int client_fd, int server_fd, const struct sockaddr_in &client_addr);
+    void sampleAcceptQueue(Listener &listener);
     void handleClientRead(int client_fd);
     void handleClientWrite(int client_fd);
+    void processClientRequest(int client_fd);
+    bool flushResponse(int client_fd);
+    bool finishResponse(int client_fd);
+    void selectServer(int client_fd);
+    bool startRequestBody(int client_fd);
+    bool setClientEvents(int client_fd, uint32_t events);
+    void queueResponse(Client *client, Response &response);
+    int sendErrorResponse(Client *client, int status_code, const std::string &message, const ConfigParser::ServerConfig &serverConfig, bool keep_connection = false);
+    bool startCGI(int client_fd, const std::string &scriptPath, const std::string &interpreter);
+    bool watchCGIFd(int fd, uint32_t events, int client_fd);
+    void unwatchCGIFd(int fd);
+    void handleCGIEvent(int fd);
+    void streamCGIOutput(int client_fd);
+    bool resumeCGIOutput(int client_fd);
+    bool startFastCGI(int client_fd, const std::string &address, const std::string &scriptPath);
+    void handleFastCGIEvent(int fd, uint32_t events);
+    bool updateFastCGIEvents(FastCGIConnection *conn);
+    void closeFastCGI(FastCGIConnection *conn);
+    void reapChildren();
+    void finishCGI(int client_fd);
+    void abortCGI(int client_fd);
+    void armTimer(int client_fd, TimeoutType type);
+    void updateReadTimer(int client_fd);
+    void expireTimers();
+    void handleTimeout(int client_fd, int type);
     void closeClientConnection(int client_fd);
     int prepareResponse(const requestParser &req, int client_fd);
     void Cleanup();
 };
 
-int create_server_socket(const std::string &host, int port);
+int create_server_socket(const ConfigParser::Listen &listen, bool reuse_port);
 std::string to_string_c98(size_t val);
-void send_error_response(int client_fd, int status_code, const std::string &message, const ConfigParser::ServerConfig &serverConfig);
-
-void send_http_headers(int client_fd, const std::string &status_line,
-                       const std::string &content_type, size_t content_length,
-                       const std::string &connection_header);
 bool isDirectory(const std::string &path);
 std::string generate_autoindex(const std::string &dir_path, const std::string &uri);
-const ConfigParser::LocationConfig *findMatchingLocation(const std::vector<ConfigParser::LocationConfig> &locations, const std::string &requestPath);
+const ConfigParser::LocationConfig *findMatchingLocation(const ConfigParser::ServerConfig &serverConfig, const std::string &requestPath);
 void normalize_path(std::string &path);
-void send_redirect_response(int client_fd, int status_code, const std::string &location_url, const std::string &status_text);
 std::string get_file_extension(const std::string &filename);
\ No newline at end of file
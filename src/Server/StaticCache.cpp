@@ -0,0 +1,145 @@
+#include "StaticCache.hpp"
+#include <cerrno>
+#include <unistd.h>
+
+StaticCache::Item::Item() : dev(0), inode(0), size(0), mtime(0), _refs(1) {}
+
+StaticCache::Item::~Item() {}
+
+void StaticCache::Item::retain()
+{
+    ++_refs;
+}
+
+void StaticCache::Item::release()
+{
+    if (--_refs == 0)
+        delete this;
+}
+
+StaticCache::StaticCache() : _capacity(0), _used(0), _hits(0), _misses(0) {}
+
+StaticCache::~StaticCache()
+{
+    clear();
+}
+
+void StaticCache::configure(size_t capacity)
+{
+    clear();
+    _capacity = capacity;
+}
+
+bool StaticCache::isEnabled() const
+{
+    return _capacity > 0;
+}
+
+bool StaticCache::accepts(const OpenFileCache::Entry &file) const
+{
+    size_t size = static_cast<size_t>(file.size);
+    return _capacity > 0 && file.file && size <= MAX_ITEM_SIZE && size <= _capacity;
+}
+
+// Returns the cached copy of the file if it is still current; the item stays
+// valid until the next call into the cache.
+StaticCache::Item *StaticCache::find(const OpenFileCache::Entry &file)
+{
+    if (!accepts(file))
+        return NULL;
+
+    std::map<std::string, ItemList::iterator>::iterator found = _index.find(file.path);
+    if (found != _index.end())
+    {
+        Item *item = *found->second;
+        if (item->dev == file.dev && item->inode == file.inode && item->size == file.size && item->mtime == file.mtime)
+        {
+            _lru.splice(_lru.begin(), _lru, found->second);
+            ++_hits;
+            return item;
+        }
+        erase(found->second);
+    }
+    ++_misses;
+    return NULL;
+}
+
+// Loads the file after a miss. Returns NULL if it could not be read.
+StaticCache::Item *StaticCache::insert(const OpenFileCache::Entry &file, const std::string &headers)
+{
+    if (!accepts(file))
+        return NULL;
+
+    std::string body;
+    if (!readBody(file, body))
+        return NULL;
+    return insert(file, headers, body);
+}
+
+// Stores body (taken over by swapping) as the cached content of the file.
+StaticCache::Item *StaticCache::insert(const OpenFileCache::Entry &file, const std::string &headers, std::string &body)
+{
+    if (!accepts(file) || body.size() > _capacity)
+        return NULL;
+
+    std::map<std::string, ItemList::iterator>::iterator found = _index.find(file.path);
+    if (found != _index.end())
+        erase(found->second);
+    while (!_lru.empty() && _used + body.size() > _capacity)
+        erase(--_lru.end());
+
+    Item *item = new Item();
+    item->path = file.path;
+    item->headers = headers;
+    item->body.swap(body);
+    item->dev = file.dev;
+    item->inode = file.inode;
+    item->size = file.size;
+    item->mtime = file.mtime;
+
+    _lru.push_front(item);
+    _index[item->path] = _lru.begin();
+    _used += item->body.size();
+    return item;
+}
+
+// pread() leaves the shared descriptor's offset alone.
+bool StaticCache::readBody(const OpenFileCache::Entry &file, std::string &body)
+{
+    body.resize(file.size);
+    size_t done = 0;
+    while (done < body.size())
+    {
+        ssize_t bytes = pread(file.file->getFd(), &body[done], body.size() - done, done);
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return false;
+        done += bytes;
+    }
+    return true;
+}
+
+void StaticCache::erase(ItemList::iterator item)
+{
+    _used -= (*item)->body.size();
+    _index.erase((*item)->path);
+    (*item)->release();
+    _lru.erase(item);
+}
+
+void StaticCache::clear()
+{
+    while (!_lru.empty())
+        erase(_lru.begin());
+}
+
+size_t StaticCache::getHits() const
+{
+    return _hits;
+}
+
+size_t StaticCache::getMisses() const
+{
+    return _misses;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <map>
+#include "OpenFileCache.hpp"
+
+// Bodies of small static files kept in memory together with their
+// serialized entity headers (Content-Type, Content-Length, ETag and
+// Last-Modified), so that a hit is answered from memory with one writev().
+// The body may also be a transformed copy of the file, such as its gzip
+// variant, kept in a cache of its own.
+// Eviction is LRU and bounded by the total size of the cached bodies. An item
+// is matched against the file's current inode, size and mtime as reported by
+// the open file cache, so it goes stale together with the file entry.
+class StaticCache
+{
+public:
+    // Items are reference counted: responses still being sent keep theirs
+    // alive after it is evicted.
+    struct Item
+    {
+        std::string path;
+        std::string headers;
+        std::string body;
+        dev_t dev;
+        ino_t inode;
+        off_t size;
+        time_t mtime;
+
+        void retain();
+        void release();
+
+    private:
+        int _refs;
+
+        Item();
+        ~Item();
+        Item(const Item &);
+        Item &operator=(const Item &);
+
+        friend class StaticCache;
+    };
+
+    // Files above this size are always streamed with sendfile().
+    static const size_t MAX_ITEM_SIZE = 256 * 1024;
+
+    StaticCache();
+    ~StaticCache();
+
+    void configure(size_t capacity);
+    Item *find(const OpenFileCache::Entry &file);
+    Item *insert(const OpenFileCache::Entry &file, const std::string &headers);
+    Item *insert(const OpenFileCache::Entry &file, const std::string &headers, std::string &body);
+    bool accepts(const OpenFileCache::Entry &file) const;
+    void clear();
+    bool isEnabled() const;
+    size_t getHits() const;
+    size_t getMisses() const;
+    static bool readBody(const OpenFileCache::Entry &file, std::string &body);
+
+private:
+    typedef std::list<Item *> ItemList;
+
+    ItemList _lru;
+    std::map<std::string, ItemList::iterator> _index;
+    size_t _capacity;
+    size_t _used;
+    size_t _hits;
+    size_t _misses;
+
+    StaticCache(const StaticCache &);
+    StaticCache &operator=(const StaticCache &);
+
+    void erase(ItemList::iterator item);
+};
@@ -0,0 +1,105 @@
+#include "TimerWheel.hpp"
+
+TimerWheel::Timer::Timer() : prev(NULL), next(NULL), expires(-1), fd(-1), type(0) {}
+
+TimerWheel::TimerWheel() : _slots(SLOTS, static_cast<Timer *>(NULL)), _current(now() / TICK_MS), _count(0) {}
+
+long TimerWheel::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// (Re)arms the timer to fire timeout_ms from now, rounded up to a whole tick.
+void TimerWheel::arm(Timer *timer, int fd, int type, long timeout_ms)
+{
+    cancel(timer);
+
+    long expires = (now() + timeout_ms + TICK_MS - 1) / TICK_MS;
+    if (expires <= _current)
+        expires = _current + 1;
+
+    Timer *&head = _slots[expires % SLOTS];
+    timer->expires = expires;
+    timer->fd = fd;
+    timer->type = type;
+    timer->prev = NULL;
+    timer->next = head;
+    if (head)
+        head->prev = timer;
+    head = timer;
+    ++_count;
+}
+
+void TimerWheel::cancel(Timer *timer)
+{
+    if (!isArmed(timer))
+        return;
+
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        _slots[timer->expires % SLOTS] = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->expires = -1;
+    --_count;
+}
+
+bool TimerWheel::isArmed(const Timer *timer) const
+{
+    return timer->expires != -1;
+}
+
+// Unlinks every timer that is due and hands it back to the caller.
+void TimerWheel::expire(std::vector<Timer *> &expired)
+{
+    long target = now() / TICK_MS;
+    long steps = target - _current;
+    if (steps > static_cast<long>(SLOTS))
+        steps = SLOTS;
+
+    for (long i = 1; i <= steps; ++i)
+    {
+        Timer *timer = _slots[(_current + i) % SLOTS];
+        while (timer)
+        {
+            Timer *next = timer->next;
+            if (timer->expires <= target)
+            {
+                cancel(timer);
+                expired.push_back(timer);
+            }
+            timer = next;
+        }
+    }
+    if (target > _current)
+        _current = target;
+}
+
+// Milliseconds until the earliest timer is due, suitable as the epoll_wait
+// timeout; -1 when nothing is armed.
+int TimerWheel::nextTimeout() const
+{
+    if (_count == 0)
+        return -1;
+
+    long current = now();
+    for (size_t i = 1; i <= SLOTS; ++i)
+    {
+        long tick = _current + i;
+        for (Timer *timer = _slots[tick % SLOTS]; timer; timer = timer->next)
+        {
+            if (timer->expires <= tick)
+            {
+                long delay = tick * TICK_MS - current;
+                return delay > 0 ? static_cast<int>(delay) : 0;
+            }
+        }
+    }
+    return static_cast<int>(SLOTS * TICK_MS);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+#include <ctime>
+
+// Hashed timing wheel. Timers are intrusive list nodes owned by whoever arms
+// them (one per connection), so arming and cancelling are O(1). Each slot
+// covers TICK_MS milliseconds; timers further away than one rotation simply
+// stay in their slot until their tick comes round.
+class TimerWheel
+{
+public:
+    static const long TICK_MS = 100;
+    static const size_t SLOTS = 1024;
+
+    struct Timer
+    {
+        Timer *prev;
+        Timer *next;
+        long expires;
+        int fd;
+        int type;
+
+        Timer();
+    };
+
+    TimerWheel();
+
+    void arm(Timer *timer, int fd, int type, long timeout_ms);
+    void cancel(Timer *timer);
+    bool isArmed(const Timer *timer) const;
+    void expire(std::vector<Timer *> &expired);
+    int nextTimeout() const;
+
+    static long now();
+
+private:
+    std::vector<Timer *> _slots;
+    long _current;
+    size_t _count;
+
+    TimerWheel(const TimerWheel &);
+    TimerWheel &operator=(const TimerWheel &);
+};
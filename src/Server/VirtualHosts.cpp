@@ -0,0 +1,172 @@
+#include "VirtualHosts.hpp"
+#include <cstring>
+
+VirtualHosts::NameTable::Entry::Entry() : value(0), used(false) {}
+
+VirtualHosts::NameTable::NameTable() : _entries(16), _count(0) {}
+
+// FNV-1a
+size_t VirtualHosts::NameTable::hash(const char *key, size_t len)
+{
+    size_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= static_cast<unsigned char>(key[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void VirtualHosts::NameTable::grow()
+{
+    std::vector<Entry> old;
+    old.swap(_entries);
+    _entries.resize(old.size() * 2);
+    _count = 0;
+    for (size_t i = 0; i < old.size(); ++i)
+    {
+        if (old[i].used)
+            insert(old[i].key, old[i].value);
+    }
+}
+
+// Returns false if the name is already taken; the first server keeps it.
+bool VirtualHosts::NameTable::insert(const std::string &key, size_t value)
+{
+    size_t existing;
+    if (find(key.data(), key.size(), existing))
+        return false;
+    if ((_count + 1) * 2 > _entries.size())
+        grow();
+
+    size_t mask = _entries.size() - 1;
+    size_t i = hash(key.data(), key.size()) & mask;
+    while (_entries[i].used)
+        i = (i + 1) & mask;
+
+    _entries[i].key = key;
+    _entries[i].value = value;
+    _entries[i].used = true;
+    ++_count;
+    return true;
+}
+
+bool VirtualHosts::NameTable::find(const char *key, size_t len, size_t &value) const
+{
+    if (_count == 0)
+        return false;
+
+    size_t mask = _entries.size() - 1;
+    for (size_t i = hash(key, len) & mask; _entries[i].used; i = (i + 1) & mask)
+    {
+        const std::string &candidate = _entries[i].key;
+        if (candidate.size() == len && std::memcmp(candidate.data(), key, len) == 0)
+        {
+            value = _entries[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool VirtualHosts::NameTable::empty() const
+{
+    return _count == 0;
+}
+
+VirtualHosts::VirtualHosts() : _default(0), _has_explicit_default(false) {}
+
+void VirtualHosts::addServer(const ConfigParser::ServerConfig &server, bool is_default)
+{
+    size_t index = _servers.size();
+    _servers.push_back(&server);
+
+    if (is_default && !_has_explicit_default)
+    {
+        _default = index;
+        _has_explicit_default = true;
+    }
+
+    for (size_t i = 0; i < server.server_names.size(); ++i)
+        addName(server.server_names[i], index);
+}
+
+void VirtualHosts::addName(const std::string &name, size_t index)
+{
+    bool added;
+
+    if (name.size() > 2 && name[0] == '*' && name[1] == '.')
+        added = _leading.insert(name.substr(1), index);
+    else if (name.size() > 2 && name[name.size() - 1] == '*' && name[name.size() - 2] == '.')
+        added = _trailing.insert(name.substr(0, name.size() - 1), index);
+    else if (name.size() > 1 && name[0] == '.')
+    {
+        // ".example.com" stands for both "example.com" and "*.example.com".
+        added = _exact.insert(name.substr(1), index);
+        added = _leading.insert(name, index) && added;
+    }
+    else
+        added = _exact.insert(name, index);
+
+    if (!added)
+        Utils::log("Conflicting server name \"" + name + "\", ignored", AnsiColor::BOLD_YELLOW);
+}
+
+const ConfigParser::ServerConfig &VirtualHosts::select(const std::string &host) const
+{
+    size_t end = host.size();
+    if (!host.empty() && host[0] == '[')
+    {
+        size_t bracket = host.find(']');
+        if (bracket != std::string::npos)
+            end = bracket + 1;
+    }
+    else if (host.find(':') != std::string::npos)
+        end = host.find(':');
+
+    std::string name;
+    name.reserve(end);
+    for (size_t i = 0; i < end; ++i)
+        name += static_cast<char>(std::tolower(static_cast<unsigned char>(host[i])));
+    while (!name.empty() && name[name.size() - 1] == '.')
+        name.erase(name.size() - 1);
+
+    if (name.empty())
+        return getDefault();
+
+    size_t index;
+    if (_exact.find(name.data(), name.size(), index))
+        return *_servers[index];
+
+    // The leftmost dot gives the longest "*.suffix" candidate.
+    if (!_leading.empty())
+    {
+        for (size_t dot = name.find('.'); dot != std::string::npos; dot = name.find('.', dot + 1))
+        {
+            if (_leading.find(name.data() + dot, name.size() - dot, index))
+                return *_servers[index];
+        }
+    }
+
+    // The rightmost dot gives the longest "prefix.*" candidate.
+    if (!_trailing.empty())
+    {
+        for (size_t dot = name.rfind('.'); dot != std::string::npos && dot > 0; dot = name.rfind('.', dot - 1))
+        {
+            if (_trailing.find(name.data(), dot + 1, index))
+                return *_servers[index];
+        }
+    }
+
+    return getDefault();
+}
+
+const ConfigParser::ServerConfig &VirtualHosts::getDefault() const
+{
+    return *_servers[_default];
+}
+
+size_t VirtualHosts::size() const
+{
+    return _servers.size();
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "../Parser/ConfigParser.hpp"
+
+// Name-based virtual hosting for one listening socket. Every server block
+// that listens on the socket is registered here and the Host header of each
+// request picks one, the way nginx does it: exact name first, then the
+// longest "*.example.com" match, then the longest "www.example.*" match, and
+// finally the default server (the one marked default_server, else the first).
+// The server blocks themselves live in the shared ConfigSnapshot.
+class VirtualHosts
+{
+public:
+    VirtualHosts();
+
+    void addServer(const ConfigParser::ServerConfig &server, bool is_default);
+    const ConfigParser::ServerConfig &select(const std::string &host) const;
+    const ConfigParser::ServerConfig &getDefault() const;
+    size_t size() const;
+
+private:
+    // Open-addressing hash table from a lower-case name to a server index.
+    class NameTable
+    {
+    public:
+        NameTable();
+
+        bool insert(const std::string &key, size_t value);
+        bool find(const char *key, size_t len, size_t &value) const;
+        bool empty() const;
+
+    private:
+        struct Entry
+        {
+            std::string key;
+            size_t value;
+            bool used;
+
+            Entry();
+        };
+
+        std::vector<Entry> _entries;
+        size_t _count;
+
+        static size_t hash(const char *key, size_t len);
+        void grow();
+    };
+
+    std::vector<const ConfigParser::ServerConfig *> _servers;
+    size_t _default;
+    bool _has_explicit_default;
+    NameTable _exact;
+    NameTable _leading;
+    NameTable _trailing;
+
+    void addName(const std::string &name, size_t index);
+};
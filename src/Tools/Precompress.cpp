@@ -0,0 +1,259 @@
+// webserv-precompress: writes the .gz and .br sidecars that gzip_static and
+// brotli_static serve. Every compressible file under the given roots is
+// compressed at the highest level of each coding, which is too slow to do per
+// request but costs nothing once done ahead of time. Files are split between
+// worker processes, one per CPU unless -j says otherwise.
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+static const char *const COMPRESSIBLE[] = {".html", ".htm", ".css", ".js", ".txt", ".svg", ".json", ".xml", NULL};
+
+static bool hasSuffix(const std::string &name, const std::string &suffix)
+{
+    return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool isCompressible(const std::string &name)
+{
+    for (size_t i = 0; COMPRESSIBLE[i]; ++i)
+        if (hasSuffix(name, COMPRESSIBLE[i]))
+            return true;
+    return false;
+}
+
+// Regular files only; symlinks are skipped so a link out of the docroot is
+// never followed.
+static void collect(const std::string &dir, size_t min_length, std::vector<std::string> &files)
+{
+    DIR *handle = opendir(dir.c_str());
+    if (!handle)
+    {
+        std::cerr << dir << ": " << std::strerror(errno) << std::endl;
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(handle)) != NULL)
+    {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..")
+            continue;
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) == -1)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            collect(path, min_length, files);
+        else if (S_ISREG(st.st_mode) && isCompressible(name) && static_cast<size_t>(st.st_size) >= min_length)
+            files.push_back(path);
+    }
+    closedir(handle);
+}
+
+static bool readFile(const std::string &path, std::string &out)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    char buffer[64 * 1024];
+    ssize_t bytes;
+    while ((bytes = read(fd, buffer, sizeof(buffer))) > 0)
+        out.append(buffer, bytes);
+    close(fd);
+    return bytes == 0;
+}
+
+static bool compressGzip(const std::string &input, std::string &output)
+{
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    output.resize(deflateBound(&stream, input.size()));
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    stream.avail_in = input.size();
+    stream.next_out = reinterpret_cast<Bytef *>(&output[0]);
+    stream.avail_out = output.size();
+    int status = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return status == Z_STREAM_END;
+}
+
+static bool compressBrotli(const std::string &input, std::string &output)
+{
+    size_t size = BrotliEncoderMaxCompressedSize(input.size());
+    output.resize(size ? size : input.size() + 1024);
+    size = output.size();
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_MAX_WINDOW_BITS, BROTLI_MODE_TEXT, input.size(),
+                               reinterpret_cast<const uint8_t *>(input.data()), &size,
+                               reinterpret_cast<uint8_t *>(&output[0])))
+        return false;
+    output.resize(size);
+    return true;
+}
+
+// The sidecar is written next to the file under a temporary name and renamed
+// into place, so the server never opens a partial one. It takes the file's
+// mode and mtime: the server skips sidecars older than their file, and this
+// tool skips files whose sidecars carry the same mtime.
+static bool writeSidecar(const std::string &path, const struct stat &st, const std::string &data)
+{
+    char pid[32];
+    std::sprintf(pid, ".%ld", static_cast<long>(getpid()));
+    std::string temp = path + pid + ".tmp";
+
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (fd == -1)
+        return false;
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t bytes = write(fd, data.data() + written, data.size() - written);
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            break;
+        written += bytes;
+    }
+    struct timespec times[2];
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    bool ok = written == data.size() && futimens(fd, times) == 0;
+    ok = close(fd) == 0 && ok;
+    if (ok && rename(temp.c_str(), path.c_str()) == 0)
+        return true;
+    unlink(temp.c_str());
+    return false;
+}
+
+static bool isCurrent(const std::string &sidecar, const struct stat &st)
+{
+    struct stat current;
+    return stat(sidecar.c_str(), &current) == 0 && current.st_mtime == st.st_mtime &&
+           current.st_mtim.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+// Writes whichever sidecars are missing or stale. A coding that does not make
+// the file smaller gets no sidecar.
+static bool precompress(const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+        return false;
+
+    std::string gz = path + ".gz";
+    std::string br = path + ".br";
+    bool need_gz = !isCurrent(gz, st);
+    bool need_br = !isCurrent(br, st);
+    if (!need_gz && !need_br)
+        return true;
+
+    std::string input;
+    if (!readFile(path, input))
+    {
+        std::cerr << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    bool ok = true;
+    std::string output;
+    if (need_gz && compressGzip(input, output) && output.size() < input.size())
+    {
+        ok = writeSidecar(gz, st, output) && ok;
+        std::cout << gz << ": " << input.size() << " -> " << output.size() << std::endl;
+    }
+    if (need_br && compressBrotli(input, output) && output.size() < input.size())
+    {
+        ok = writeSidecar(br, st, output) && ok;
+        std::cout << br << ": " << input.size() << " -> " << output.size() << std::endl;
+    }
+    if (!ok)
+        std::cerr << path << ": could not write sidecar: " << std::strerror(errno) << std::endl;
+    return ok;
+}
+
+static int usage()
+{
+    std::cerr << "Usage: webserv-precompress [-j jobs] [-m min_length] docroot..." << std::endl;
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t min_length = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:m:")) != -1)
+    {
+        char *end;
+        long value = optarg ? std::strtol(optarg, &end, 10) : 0;
+        if (opt == '?' || !optarg || *end != '\0' || value < (opt == 'j' ? 1 : 0))
+            return usage();
+        if (opt == 'j')
+            jobs = value;
+        else
+            min_length = value;
+    }
+    if (optind == argc)
+        return usage();
+    if (jobs < 1)
+        jobs = 1;
+
+    std::vector<std::string> files;
+    for (int i = optind; i < argc; ++i)
+    {
+        std::string root = argv[i];
+        while (root.size() > 1 && root[root.size() - 1] == '/')
+            root.erase(root.size() - 1);
+        collect(root, min_length, files);
+    }
+    if (static_cast<size_t>(jobs) > files.size())
+        jobs = files.empty() ? 1 : files.size();
+
+    // Worker k takes every jobs-th file starting at k, which spreads large and
+    // small files evenly enough without any coordination.
+    std::cout.flush();
+    std::vector<pid_t> workers;
+    for (long k = 0; k < jobs; ++k)
+    {
+        pid_t pid = fork();
+        if (pid == -1)
+        {
+            perror("fork");
+            break;
+        }
+        if (pid == 0)
+        {
+            bool ok = true;
+            for (size_t i = k; i < files.size(); i += jobs)
+                ok = precompress(files[i]) && ok;
+            std::cout.flush();
+            _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        workers.push_back(pid);
+    }
+
+    int result = static_cast<long>(workers.size()) == jobs ? EXIT_SUCCESS : EXIT_FAILURE;
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        int status;
+        while (waitpid(workers[i], &status, 0) == -1 && errno == EINTR)
+            ;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            result = EXIT_FAILURE;
+    }
+    return result;
+}
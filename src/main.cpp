@@ -2,6 +2,7 @@
 #include "./Utils/Logger.hpp"
 #include "Utils/AnsiColor.hpp"
 #include "Server/Server.hpp"
+#include "Server/Master.hpp"
 
 void printBanner() {
     Utils::log(" █     █░▓█████  ▄▄▄▄     ██████ ▓█████  ██▀███   ██▒   █▓", AnsiColor::BOLD_BLUE);
@@ -33,10 +34,14 @@ int start_server(const std::string &config_path)
     size_t serverCount = parser.getServerCount();
     Utils::log("Found " + Utils::intToString(serverCount) + " server configurations", AnsiColor::BOLD_CYAN);
     parser.printConfig();
-    Server server;
-    server.setupServers(parser);
-    server.handleConnections();
-    server.Cleanup();
+    if (parser.getWorkerProcesses() > 1)
+    {
+        Master master(parser);
+        if (master.run() != 0)
+            return 1;
+    }
+    else
+        Master::runWorker(parser, false);
     std::cout << AnsiColor::BOLD_RED << "Webserv stopped" << AnsiColor::RESET << std::endl;
     return 0;
 }